@@ -5,10 +5,12 @@
 #include "assert.h"
 #include "stdbool.h"
 #include "string.h"
+#include "stddef.h"
 
 typedef struct MemoryBlock MemoryBlock;
 struct MemoryBlock {
     MemoryBlock *next;
+    int64_t size; // including this header
 };
 
 typedef enum RBT_Color RBT_Color;
@@ -17,67 +19,594 @@ enum RBT_Color {
     RBT_BLACK,
 };
 
+// Every chunk starts with a boundary tag (previous_size, size), occupied chunks carry nothing else.
+// Red-black tree links overlay the beginning of the payload, so they exist only while the chunk is free
 typedef struct AllocationNode AllocationNode;
 struct AllocationNode {
-    int64_t size;
-    int64_t used_size; // arena currently doesn't create nodes smaller than sizeof(AllocationNode), so they remain as a part of the previous node, affecting its size. And in some cases we want to know what is the size that user asked for
+    int64_t previous_size; // payload size of the previous chunk in the same memory block, 0 if this chunk is the first one
+    int64_t size;          // payload size, lowest bit is set if the chunk is occupied (see ALLOCATION_NODE_OCCUPIED)
 
-    // note: we don't need these field if the memory is allocate, means that it is face to hand them to the user, decreasing allocation overhead!
+    // note: fields below are valid only for free chunks and for chunks cached in quick lists, occupied chunks hand this memory to the user
     AllocationNode  *parent;
     AllocationNode  *left;
     AllocationNode  *right;
-    AllocationNode  *previous; 
-    AllocationNode  *next;
+    AllocationNode  *previous; // free list link, used only by ALLOCATORS_TLSF
+    AllocationNode  *next; // free list link of ALLOCATORS_TLSF, and the link of quick lists (see HEAP_QUICK_LIST_DEPTH)
     RBT_Color color;
-    bool occupied;
+};
 
-    // todo: it is trivial to remove this field: it is used only during HeapArenaFree, and wouldn't be nessesary even there is we don't link nodes that belong to different memory block
-    MemoryBlock     *memory_block;
-    AllocationNode  *previous_in_order;
-    AllocationNode  *next_in_order;
+#define ALLOCATION_NODE_OCCUPIED    1
+#define ALLOCATION_NODE_LARGE       4 // chunk is a dedicated mapping, see HeapLargeAllocation
+#define ALLOCATION_NODE_SAMPLED     8 // allocation is tracked by the heap profiler, it can be set in front of any kind of memory, see HeapProfileSample
+#define ALLOCATION_NODE_FLAGS       15
+#define ALLOCATION_NODE_HEADER_SIZE ((int64_t)offsetof(AllocationNode, parent))
+// every chunk size is a multiple of ALLOCATION_GRANULARITY, so every payload returned by HeapArenaAllocate is aligned to it
+#define ALLOCATION_GRANULARITY      16
+// free chunk should be able to hold its tree links
+#define ALLOCATION_NODE_MIN_SIZE    ((int64_t)sizeof(AllocationNode) - ALLOCATION_NODE_HEADER_SIZE)
+
+
+// small allocations, up to HEAP_SLAB_MAX_SIZE bytes, bypass the tree, see HeapSlabAllocate
+#define HEAP_SLAB_CLASS_COUNT 21
+#define HEAP_SLAB_MAX_SIZE    512
+typedef struct HeapSlab HeapSlab;
+
+// Freed chunks of up to HEAP_QUICK_LIST_MAX_SIZE bytes are kept in quick lists by their exact size, still marked occupied, and given back
+// to the next allocation of the same size without touching the free index. Chunks are coalesced and put into the index only when a list holds
+// more than HEAP_QUICK_LIST_DEPTH chunks or the index can't serve a request, and by HeapArenaTrim. Cached chunks are reused most recent first, which gives up address-ordered
+// placement for their sizes, define HEAP_QUICK_LIST_DEPTH to 0 to free chunks immediately when footprint matters more than speed
+#ifndef HEAP_QUICK_LIST_MAX_SIZE
+#define HEAP_QUICK_LIST_MAX_SIZE 2048
+#endif
+#ifndef HEAP_QUICK_LIST_DEPTH
+#define HEAP_QUICK_LIST_DEPTH 16
+#endif
+#define HEAP_QUICK_LIST_COUNT ((HEAP_QUICK_LIST_MAX_SIZE - HEAP_SLAB_MAX_SIZE) / ALLOCATION_GRANULARITY)
+
+// allocations of at least HEAP_ARENA_LARGE_ALLOCATION_SIZE bytes get their own mapping, they are never split or coalesced.
+// Header is right in front of the payload, close to the start of the mapping, unless the payload was moved further to align it
+typedef struct HeapLargeAllocation HeapLargeAllocation;
+struct HeapLargeAllocation {
+    HeapLargeAllocation *next;
+    HeapLargeAllocation *previous;
+    uint8_t *mapping;
+    int64_t mapped_size; // including everything in front of the payload
+    int64_t size; // same as AllocationNode size, so the word in front of the payload tells what kind of memory it is
 };
 
+// Free chunks are indexed by the red-black tree, or with ALLOCATORS_TLSF by two-level segregated fit lists (see HeapTLSFMapping),
+// which take constant time for every operation, but give good fit instead of the best one.
+// Every first level class is a power of two range split into HEAP_TLSF_SECOND_LEVEL_COUNT classes, sizes below HEAP_TLSF_LINEAR_SIZE are split by ALLOCATION_GRANULARITY
+#ifdef ALLOCATORS_TLSF
+#define HEAP_TLSF_SECOND_LEVEL_LOG2  4
+#define HEAP_TLSF_SECOND_LEVEL_COUNT (1 << HEAP_TLSF_SECOND_LEVEL_LOG2)
+#define HEAP_TLSF_LINEAR_LOG2        (HEAP_TLSF_SECOND_LEVEL_LOG2 + 4) // 4 is log2 of ALLOCATION_GRANULARITY
+#define HEAP_TLSF_LINEAR_SIZE        ((int64_t)1 << HEAP_TLSF_LINEAR_LOG2)
+#define HEAP_TLSF_FIRST_LEVEL_COUNT  (64 - HEAP_TLSF_LINEAR_LOG2)
+#endif
+
+// Debug mode (ALLOCATORS_DEBUG): every allocation gets a canary in front of it and behind it, free and realloc check both canaries and the live flag,
+// so overflows, double frees and pointers that weren't returned by the arena are reported (see HEAP_DEBUG_REPORT) instead of corrupting the free index.
+// Freed payloads are poisoned. The checks themselves take a few nanoseconds, most of the cost is the 24 bytes added to every allocation,
+// which moves small allocations to larger size classes.
+// ALLOCATORS_DEBUG_GUARD_PAGES additionally gives every allocation its own mapping that ends with an inaccessible page right after the allocation,
+// so overflows fault at once, it costs at least two pages and two mappings per allocation (mind vm.max_map_count on Linux) and system calls on every allocation and free
+#if defined(ALLOCATORS_DEBUG_GUARD_PAGES) && !defined(ALLOCATORS_DEBUG)
+#define ALLOCATORS_DEBUG
+#endif
+
+// Statistics histograms count chunks by log2 of their size: bucket i holds sizes in [2^i, 2^(i+1)), the last bucket holds everything larger
+#define HEAP_STATS_BUCKET_COUNT 40
 
 typedef struct HeapArena HeapArena;
 struct HeapArena {
-    AllocationNode *root; // root of the red-black tree of allocations
-    AllocationNode *first_node; // first node, in order 
-    AllocationNode *last_node;
+#ifdef ALLOCATORS_TLSF
+    uint64_t free_first_level; // bit per first level class that has a free chunk
+    uint32_t free_second_level[HEAP_TLSF_FIRST_LEVEL_COUNT]; // bit per second level class that has a free chunk
+    AllocationNode *free_lists[HEAP_TLSF_FIRST_LEVEL_COUNT][HEAP_TLSF_SECOND_LEVEL_COUNT]; // linked through previous and next of the chunks
+#else
+    AllocationNode *root; // root of the red-black tree of free chunks
+#endif
     MemoryBlock *first_block;
     MemoryBlock *last_block;
+    HeapSlab *slabs[HEAP_SLAB_CLASS_COUNT]; // per size class, slabs that have at least one free slot
+    HeapLargeAllocation *large_allocations;
+
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+    MemoryBlock *reserved_block; // block that grows inside the reserved range, it is never released by trim
+    bool reserve_failed; // platform refused to reserve the range, arena uses separate blocks only
+#endif
+
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    struct HeapDebugGuarded *guarded_allocations;
+#endif
+
+#if HEAP_QUICK_LIST_DEPTH
+    AllocationNode *quick_lists[HEAP_QUICK_LIST_COUNT]; // linked through next of the chunks
+    int32_t quick_counts[HEAP_QUICK_LIST_COUNT];
+    int64_t quick_size; // payload of the chunks in quick lists
+#endif
 
     int64_t allocated_size;
     int64_t free_size;
+    int64_t freed_since_trim; // automatic trim walks every block, so it runs at most once per HEAP_ARENA_TRIM_THRESHOLD / 2 freed bytes
+
+    // position of the incremental validation (see HeapArenaValidateStep), chunks that are merged into the chunk in front of them
+    // and blocks that are given back to the platform move it, so it always points to a chunk
+    MemoryBlock *validate_block;
+    AllocationNode *validate_node; // next chunk to check, 0 if the block is checked from its header
+
+    // statistics are updated along with the arena itself, see HeapArenaGetStats
+    int64_t live_size;
+    int64_t live_count;
+    int64_t block_count;
+    int64_t large_count;
+    int64_t free_chunk_count;
+#ifndef ALLOCATORS_TLSF
+    int64_t largest_free_size; // size of the rightmost node of the tree, found again only when a chunk of this size leaves it
+#endif
+    int64_t live_histogram[HEAP_STATS_BUCKET_COUNT];
+    int64_t free_histogram[HEAP_STATS_BUCKET_COUNT];
+};
+
+typedef struct HeapArenaStats HeapArenaStats;
+struct HeapArenaStats {
+    int64_t allocated_size; // memory taken from the platform
+    int64_t free_size; // payload of the free chunks
+    int64_t cached_size; // payload of the freed chunks kept in quick lists, they aren't counted as free
+    int64_t live_size; // usable size of live allocations
+    int64_t overhead_size; // everything else: headers, fences, unused slab slots, page rounding of large allocations
+    int64_t live_count;
+    int64_t block_count;
+    int64_t large_count; // allocations that got their own mapping, they are counted in live_count as well
+    int64_t free_chunk_count;
+    int64_t largest_free_chunk; // with ALLOCATORS_TLSF it is the largest size of the highest class that has a free chunk, never more than free_size
+    double fragmentation; // 1 - largest_free_chunk / free_size: zero if all free memory is a single chunk, close to one if it is scattered
+    int64_t live_histogram[HEAP_STATS_BUCKET_COUNT]; // by usable size
+    int64_t free_histogram[HEAP_STATS_BUCKET_COUNT];
 };
 
+// allocation functions return 0 if the platform has no memory, realloc keeps the old memory then
 void *HeapArenaAllocate(HeapArena *arena, int64_t size);
+void *HeapArenaAllocateAligned(HeapArena *arena, int64_t size, int64_t alignment); // alignment should be a power of two
+void *HeapArenaAllocateZeroed(HeapArena *arena, int64_t size);
 void *HeapArenaRealloc(HeapArena *arena, void *memory, int64_t new_size);
 void HeapArenaFree(HeapArena *arena, void *memory);
+void HeapArenaAllocateBatch(HeapArena *arena, int64_t size, int64_t count, void **memory); // count allocations of the same size, cut from one free chunk, 0 for the ones that failed
+void HeapArenaFreeBatch(HeapArena *arena, void **memory, int64_t count); // reorders memory by address, adjacent chunks are merged before they reach the free index
+void HeapArenaCopyMemory(void *dest, void *source, int64_t size);
+void HeapArenaZeroMemory(void *dest, int64_t size);
+int64_t HeapArenaUsableSize(void *memory);
+int64_t HeapArenaTrim(HeapArena *arena, int64_t keep_bytes); // returns how many bytes were given back to the platform
 void HeapArenaRelease(HeapArena *arena);
 void HeapArenaDump(HeapArena *arena);
+HeapArenaStats HeapArenaGetStats(HeapArena *arena); // cheap enough to be called at any moment, but only by the thread that uses the arena
+
+// Validation walks every block chunk by chunk and checks it against the free index: boundary tags of the neighbours agree, free chunks are never adjacent,
+// every free chunk is in the index (in order, red nodes have black children and every path has the same count of black nodes, or in the list of its
+// TLSF class with the class marked in the bitmaps). HeapArenaValidate also checks that the totals of the walk match the arena statistics,
+// that the index holds nothing else, and the lists of slabs, quick lists and large allocations. It takes O(n log n) time and stops the arena for all of it.
+// HeapArenaValidateStep checks at most chunk_budget chunks per call, each free one costs O(log n), and the next call continues where this one stopped,
+// so a heap of any size can be checked continuously between the calls that use it. Arena changes between the steps, so only the invariants of single chunks
+// are checked and the totals are left to HeapArenaValidate. Both should be called by the thread that uses the arena, corrupted memory may crash the walk
+typedef struct HeapArenaValidation HeapArenaValidation;
+struct HeapArenaValidation {
+    const char *error; // first broken invariant, 0 if the arena is consistent
+    void *memory; // chunk, block, slab or large allocation that breaks it
+    bool finished; // every block was checked since the pass started, always true for HeapArenaValidate
+};
+
+HeapArenaValidation HeapArenaValidate(HeapArena *arena);
+HeapArenaValidation HeapArenaValidateStep(HeapArena *arena, int64_t chunk_budget);
+
+// Pool arena serves objects of a single size from slabs of POOL_ARENA_SLAB_SIZE bytes, freed slots are linked into a list through their own memory,
+// so objects carry no header and allocation and free take constant time. Slots are numbered across the slabs, so an object can be referred to
+// by a 32-bit index: index to pointer is constant time, pointer to index is a binary search over the slabs.
+// Slabs are separate platform allocations, so PoolArenaRelease makes a platform call per slab rather than one call for the whole pool,
+// reset is what drops every object in constant time. Slots are aligned to the pointer size, to ALLOCATION_GRANULARITY if the object size is a multiple of it
+typedef struct PoolArena PoolArena;
+struct PoolArena {
+    void    *free_list; // freed slots, next pointer is stored in the slot itself
+    uint8_t *cursor; // slots of the current slab past the cursor weren't used since the reset
+    uint8_t *end;
+    int64_t current_slab; // -1 until the first allocation
+
+    uint8_t **slabs; // by slab number, slot index is slab number * slot_count + slot
+    int32_t *sorted_slabs; // slab numbers ordered by address, for PoolArenaGetIndex
+    int64_t slab_count;
+    int64_t slab_capacity;
+
+    int64_t slot_size;
+    int64_t slot_count; // per slab
+    int64_t slab_size;
+    int64_t used_count;
+};
+
+void PoolArenaInit(PoolArena *arena, int64_t object_size);
+void *PoolArenaAllocate(PoolArena *arena);
+void PoolArenaFree(PoolArena *arena, void *memory);
+void PoolArenaReset(PoolArena *arena); // frees every object at once, slabs are kept for reuse
+void PoolArenaRelease(PoolArena *arena); // gives slabs back to the platform one by one, arena should be initialized again before use
+uint32_t PoolArenaGetIndex(PoolArena *arena, void *memory);
+void *PoolArenaFromIndex(PoolArena *arena, uint32_t index);
+
+// Thread-safe mode: every thread allocates from its own heap, memory may be freed by any thread.
+// Frees of memory that belongs to the other heap are queued to that heap and processed by its owner on the next allocation.
+// Same as HeapArena, allocation returns 0 if the platform has no memory and realloc keeps the old memory then
+#ifdef ALLOCATORS_THREAD_SAFE
+typedef struct ThreadHeap ThreadHeap;
+
+void *ThreadHeapAllocate(int64_t size);
+void *ThreadHeapAllocateAligned(int64_t size, int64_t alignment);
+void *ThreadHeapRealloc(void *memory, int64_t new_size);
+void ThreadHeapFree(void *memory);
+void ThreadHeapRelease(void); // should be called before the thread exits, so its heap can be reused by the other threads
+#endif
+
+// Tracing (ALLOCATORS_TRACE): calls to HeapArenaAllocate, HeapArenaAllocateAligned, HeapArenaAllocateZeroed, HeapArenaRealloc and HeapArenaFree
+// (batches are written as separate calls) are written to the trace file while it is open, so the same allocation pattern can be replayed later (see examples/linux/trace_replay.c).
+// Trace format is always declared, so traces can be read by programs built without tracing
+#define HEAP_TRACE_MAGIC   0x43525448 // "HTRC"
+#define HEAP_TRACE_VERSION 1
+
+typedef enum HeapTraceOp HeapTraceOp;
+enum HeapTraceOp {
+    HEAP_TRACE_ALLOCATE,
+    HEAP_TRACE_ALLOCATE_ZEROED,
+    HEAP_TRACE_REALLOC,
+    HEAP_TRACE_FREE,
+};
+
+// Trace file starts with two uint32_t: HEAP_TRACE_MAGIC and HEAP_TRACE_VERSION, then records follow till the end of the file
+typedef struct HeapTraceRecord HeapTraceRecord;
+struct HeapTraceRecord {
+    int64_t time; // nanoseconds since HeapTraceStart
+    int64_t size; // requested size (new size for realloc), zero for free
+    uint32_t object; // ids of freed objects are reused, so the largest id stays close to the peak count of live objects
+    uint16_t thread; // threads are numbered in order of their first traced call
+    uint8_t op; // HeapTraceOp
+    uint8_t alignment_log2; // zero if the alignment wasn't requested
+};
+
+#ifdef ALLOCATORS_TRACE
+bool HeapTraceStart(const char *path); // returns false if the file can't be created or trace is already running
+void HeapTraceStop(void);
+#endif
+
+// Sampling heap profiler (ALLOCATORS_PROFILE): about one allocation per HEAP_PROFILE_SAMPLE_RATE allocated bytes gets its call stack recorded,
+// so the overhead is bounded by the rate, not by the count of allocations. Samples of freed memory are dropped, numbers of everything allocated
+// since HeapProfileStart are kept. Dump is written in the heap profile format of gperftools (heap_v2), which pprof reads and unsamples:
+//     pprof -sample_index=inuse_space <program> <profile>, or alloc_space for cumulative numbers
+#ifdef ALLOCATORS_PROFILE
+void HeapProfileStart(int64_t sample_rate); // average count of bytes between samples, 0 for HEAP_PROFILE_SAMPLE_RATE
+void HeapProfileStop(void);
+bool HeapProfileDump(const char *path); // returns false if the file can't be created
+#endif
 
 #endif /* ALLOCATORS_H */
 
 #ifdef ALLOCATORS_IMPLEMENTATION
 
-// These function should be defined by the user
-void *PlatformGetMemory(int64_t size);
-void  PlatformFreeMemory(void *memory);
+// These function should be defined by the user (or by the library, see ALLOCATORS_PLATFORM_LINUX below)
+void *PlatformGetMemory(int64_t size); // returns 0 if there is no memory
+void  PlatformFreeMemory(void *memory, int64_t size); // size is the same that was given to PlatformGetMemory (or PlatformResizeMemory)
+
+// Optionally, platform can resize memory returned by PlatformGetMemory without copying it (mremap on Linux), then define ALLOCATORS_PLATFORM_RESIZE and
+// void *PlatformResizeMemory(void *memory, int64_t old_size, int64_t new_size); // returns 0 if memory can't be resized
+// it is used to reallocate large allocations
+#ifdef ALLOCATORS_PLATFORM_LINUX
+#define ALLOCATORS_PLATFORM_RESIZE
+#endif
+
+// Heap profiler needs call stacks, PlatformCaptureStack should write return addresses of the current thread to frames and return their count
+#ifdef ALLOCATORS_PROFILE
+int64_t PlatformCaptureStack(void **frames, int64_t max_count);
+#endif
+
+#ifdef ALLOCATORS_PLATFORM_RESIZE
+void *PlatformResizeMemory(void *memory, int64_t old_size, int64_t new_size);
+#endif
+
+// Contiguous heap (ALLOCATORS_CONTIGUOUS_HEAP), linear arena (ALLOCATORS_LINEAR_ARENA) and guard pages (ALLOCATORS_DEBUG_GUARD_PAGES) need the platform to reserve address space without backing it
+// with memory, and to back it later (provided by ALLOCATORS_PLATFORM_LINUX, VirtualAlloc with MEM_RESERVE and MEM_COMMIT on Windows).
+// Reserved range is released by PlatformFreeMemory
+#if defined(ALLOCATORS_CONTIGUOUS_HEAP) || defined(ALLOCATORS_LINEAR_ARENA) || defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+void *PlatformReserveMemory(int64_t size); // returns 0 if the range can't be reserved
+bool  PlatformCommitMemory(void *memory, int64_t size); // page aligned part of the reserved range, returns false if there is no memory
+void  PlatformDecommitMemory(void *memory, int64_t size); // gives the memory back, but keeps the range reserved
+#endif
 
 // also, NORMAL_ALLOCATION_SIZE macro can be defined to set default page size for the allocator, for example:
 // #define NORMAL_ALLOCATION_SIZE 1024*1024
 
-// I requested size is larger than NORMAL_ALLOCATION_SIZE, then allocator will try to allocate page that has exactly the desired size (todo: right now it doesn't account for allocation granularity, and may waste so memory)
+// Memory blocks that become entirely free are given back to the platform once free memory exceeds HEAP_ARENA_TRIM_THRESHOLD.
+// Arena then keeps only half of the threshold, so it doesn't map and unmap the same blocks when the load goes up and down,
+// and the next automatic trim waits for another half of the threshold to be freed. Define it to 0 to trim only manually, with HeapArenaTrim
+// #define HEAP_ARENA_TRIM_THRESHOLD 32*1024*1024
+
+// With ALLOCATORS_CONTIGUOUS_HEAP arena reserves HEAP_ARENA_RESERVE_SIZE bytes of address space on the first allocation and grows its only block
+// inside of it by at least HEAP_ARENA_COMMIT_SIZE bytes, so every chunk has neighbours to coalesce with. Trim decommits the free tail of the block.
+// If the reservation is used up or can't be made, arena falls back to separate blocks
+// #define HEAP_ARENA_RESERVE_SIZE (int64_t)16*1024*1024*1024
+
+// I requested size is larger than NORMAL_ALLOCATION_SIZE, then allocator will try to allocate page that has exactly the desired size, rounded up to HEAP_ARENA_PAGE_SIZE.
+// With ALLOCATORS_HUGE_PAGES defined, blocks and large allocations of at least HEAP_ARENA_HUGE_PAGE_SIZE are rounded up to it, so the platform can back them with huge pages
 
 #ifndef NORMAL_ALLOCATION_SIZE
 #define NORMAL_ALLOCATION_SIZE 1024
 #endif
 
+#ifndef HEAP_ARENA_TRIM_THRESHOLD
+#define HEAP_ARENA_TRIM_THRESHOLD 32*1024*1024
+#endif
+
+// Allocations that are at least this large bypass memory blocks and the tree, and are given back to the platform as soon as they are freed
+#ifndef HEAP_ARENA_LARGE_ALLOCATION_SIZE
+#if NORMAL_ALLOCATION_SIZE > 128*1024
+#define HEAP_ARENA_LARGE_ALLOCATION_SIZE NORMAL_ALLOCATION_SIZE
+#else
+#define HEAP_ARENA_LARGE_ALLOCATION_SIZE 128*1024
+#endif
+#endif
+
+#ifndef HEAP_ARENA_PAGE_SIZE
+#define HEAP_ARENA_PAGE_SIZE 4096
+#endif
+
+#ifndef HEAP_ARENA_RESERVE_SIZE
+#define HEAP_ARENA_RESERVE_SIZE (int64_t)16*1024*1024*1024
+#endif
+
+#ifndef HEAP_ARENA_COMMIT_SIZE
+#if NORMAL_ALLOCATION_SIZE > 1024*1024
+#define HEAP_ARENA_COMMIT_SIZE NORMAL_ALLOCATION_SIZE
+#else
+#define HEAP_ARENA_COMMIT_SIZE 1024*1024
+#endif
+#endif
+
+#ifndef HEAP_ARENA_HUGE_PAGE_SIZE
+#define HEAP_ARENA_HUGE_PAGE_SIZE 2*1024*1024
+#endif
+
 #include "stdlib.h"
 #include "stdbool.h"
 #include "stdint.h"
 #include "stdio.h"
 #include "assert.h"
+#include "time.h"
+#if defined(_MSC_VER)
+#include "intrin.h"
+#endif
+
+// Linux platform layer, define ALLOCATORS_PLATFORM_LINUX together with ALLOCATORS_IMPLEMENTATION to get Platform* functions built on top of mmap.
+// Huge pages are used only for sizes that are multiples of HEAP_ARENA_HUGE_PAGE_SIZE (see ALLOCATORS_HUGE_PAGES): explicit ones, if the system has them reserved,
+// otherwise transparent ones, requested with madvise
+#ifdef ALLOCATORS_PLATFORM_LINUX
+#include "sys/mman.h"
+
+// note: these are declared only with _GNU_SOURCE/_DEFAULT_SOURCE, which should be defined before the first system header, so we can't rely on them
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE 1
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0x4000
+#endif
+extern void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+extern int   madvise(void *address, size_t size, int advice);
+
+static inline bool PlatformUseHugePages(int64_t size) {
+#ifdef ALLOCATORS_HUGE_PAGES
+    return size >= HEAP_ARENA_HUGE_PAGE_SIZE && !(size & (HEAP_ARENA_HUGE_PAGE_SIZE - 1));
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+void *PlatformGetMemory(int64_t size) {
+    int protection = PROT_READ|PROT_WRITE;
+    int flags      = MAP_PRIVATE|MAP_ANONYMOUS;
+    if (!PlatformUseHugePages(size)) {
+        void *memory = mmap(0, size, protection, flags, -1, 0);
+        if (memory == MAP_FAILED) {
+            return 0;
+        }
+        return memory;
+    }
+
+    void *memory = mmap(0, size, protection, flags|MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+        return memory;
+    }
+
+    // note: transparent huge pages back only aligned ranges, so we map one huge page more and cut off the ends
+    int64_t mapped_size = size + HEAP_ARENA_HUGE_PAGE_SIZE;
+    uint8_t *mapped = mmap(0, mapped_size, protection, flags, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return 0;
+    }
+
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)mapped + HEAP_ARENA_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_ARENA_HUGE_PAGE_SIZE - 1));
+    int64_t head_size = aligned - mapped;
+    int64_t tail_size = mapped_size - head_size - size;
+    if (head_size) {
+        munmap(mapped, head_size);
+    }
+    if (tail_size) {
+        munmap(aligned + size, tail_size);
+    }
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+void PlatformFreeMemory(void *memory, int64_t size) {
+    munmap(memory, size);
+}
+
+#ifdef ALLOCATORS_PROFILE
+#include "execinfo.h"
+
+int64_t PlatformCaptureStack(void **frames, int64_t max_count) {
+    return backtrace(frames, (int)max_count);
+}
+#endif
+
+void *PlatformResizeMemory(void *memory, int64_t old_size, int64_t new_size) {
+    void *res = mremap(memory, old_size, new_size, MREMAP_MAYMOVE);
+    if (res == MAP_FAILED) {
+        return 0;
+    }
+    return res;
+}
+
+// note: reserved range is mapped without access and without swap accounting, so it costs nothing until it is committed
+void *PlatformReserveMemory(int64_t size) {
+    void *memory = mmap(0, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        return 0;
+    }
+    return memory;
+}
+
+bool PlatformCommitMemory(void *memory, int64_t size) {
+    return mprotect(memory, size, PROT_READ|PROT_WRITE) == 0;
+}
+
+// note: mapping the range over again frees its pages at once and makes it inaccessible, as it was just after the reservation
+void PlatformDecommitMemory(void *memory, int64_t size) {
+    mmap(memory, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0);
+}
+#endif
+
+#if defined(_MSC_VER)
+#define ALLOCATORS_THREAD_LOCAL __declspec(thread)
+#else
+#define ALLOCATORS_THREAD_LOCAL __thread
+#endif
+
+#if defined(ALLOCATORS_THREAD_SAFE) || defined(ALLOCATORS_TRACE) || defined(ALLOCATORS_PROFILE)
+#if defined(_MSC_VER)
+#include "intrin.h"
+
+static inline bool AtomicCompareExchangePointer(void *volatile *dest, void *expected, void *desired) {
+    return _InterlockedCompareExchangePointer(dest, desired, expected) == expected;
+}
+
+static inline void *AtomicExchangePointer(void *volatile *dest, void *value) {
+    return _InterlockedExchangePointer(dest, value);
+}
+
+// note: msvc gives volatile loads acquire semantics on x86/x64
+static inline void *AtomicLoadPointer(void *volatile *source) {
+    return *source;
+}
+
+static inline bool AtomicCompareExchange32(volatile int32_t *dest, int32_t expected, int32_t desired) {
+    return _InterlockedCompareExchange((volatile long*)dest, desired, expected) == expected;
+}
+
+static inline void AtomicStore32(volatile int32_t *dest, int32_t value) {
+    _InterlockedExchange((volatile long*)dest, value);
+}
+
+static inline int32_t AtomicLoad32(volatile int32_t *source) {
+    return *source;
+}
+#else
+static inline bool AtomicCompareExchangePointer(void *volatile *dest, void *expected, void *desired) {
+    return __atomic_compare_exchange_n(dest, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline void *AtomicExchangePointer(void *volatile *dest, void *value) {
+    return __atomic_exchange_n(dest, value, __ATOMIC_ACQ_REL);
+}
+
+static inline void *AtomicLoadPointer(void *volatile *source) {
+    return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+static inline bool AtomicCompareExchange32(volatile int32_t *dest, int32_t expected, int32_t desired) {
+    return __atomic_compare_exchange_n(dest, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void AtomicStore32(volatile int32_t *dest, int32_t value) {
+    __atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+
+static inline int32_t AtomicLoad32(volatile int32_t *source) {
+    return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+#endif
+#endif
+
+#ifdef ALLOCATORS_THREAD_SAFE
+
+// Page map: two-level radix tree that maps every 4KB page of the memory blocks to the arena that owns it.
+// That's how a thread finds the heap of the memory it is about to free
+#define HEAP_PAGE_MAP_SHIFT      12
+#define HEAP_PAGE_MAP_LEAF_BITS  18
+#define HEAP_PAGE_MAP_ROOT_BITS  (48 - HEAP_PAGE_MAP_SHIFT - HEAP_PAGE_MAP_LEAF_BITS)
+#define HEAP_PAGE_MAP_LEAF_COUNT ((int64_t)1 << HEAP_PAGE_MAP_LEAF_BITS)
+#define HEAP_PAGE_MAP_ROOT_COUNT ((int64_t)1 << HEAP_PAGE_MAP_ROOT_BITS)
+
+static HeapArena **heap_page_map[HEAP_PAGE_MAP_ROOT_COUNT];
+static volatile int32_t heap_page_map_lock;
+
+static inline HeapArena **HeapPageMapGetLeaf(uintptr_t page) {
+    uintptr_t root_index = page >> HEAP_PAGE_MAP_LEAF_BITS;
+    assert(root_index < HEAP_PAGE_MAP_ROOT_COUNT);
+    return AtomicLoadPointer((void *volatile *)&heap_page_map[root_index]);
+}
+
+static inline HeapArena *HeapPageMapGet(void *memory) {
+    uintptr_t page = (uintptr_t)memory >> HEAP_PAGE_MAP_SHIFT;
+    HeapArena **leaf = HeapPageMapGetLeaf(page);
+    assert(leaf && "Memory doesn't belong to any heap");
+    return leaf[page & (HEAP_PAGE_MAP_LEAF_COUNT - 1)];
+}
+
+// returns false if there is no memory for a leaf, pages before the failed one are set already, clearing never fails
+static bool HeapPageMapSet(void *memory, int64_t size, HeapArena *arena) {
+    uintptr_t first_page = (uintptr_t)memory >> HEAP_PAGE_MAP_SHIFT;
+    uintptr_t last_page  = ((uintptr_t)memory + size - 1) >> HEAP_PAGE_MAP_SHIFT;
+    for (uintptr_t page=first_page; page<=last_page; ++page) {
+        HeapArena **leaf = HeapPageMapGetLeaf(page);
+        if (!leaf && !arena) {
+            continue;
+        }
+        if (!leaf) {
+            // note: leaves are created once per gigabyte of address space, so taking the lock here is fine
+            while (!AtomicCompareExchange32(&heap_page_map_lock, 0, 1)) {
+            }
+            leaf = HeapPageMapGetLeaf(page);
+            if (!leaf) {
+                int64_t leaf_size = HEAP_PAGE_MAP_LEAF_COUNT * sizeof(HeapArena*);
+                leaf = PlatformGetMemory(leaf_size);
+                if (leaf) {
+                    memset(leaf, 0, leaf_size);
+                    AtomicExchangePointer((void *volatile *)&heap_page_map[page >> HEAP_PAGE_MAP_LEAF_BITS], leaf);
+                }
+            }
+            AtomicStore32(&heap_page_map_lock, 0);
+            if (!leaf) {
+                return false;
+            }
+        }
+        leaf[page & (HEAP_PAGE_MAP_LEAF_COUNT - 1)] = arena;
+    }
+    return true;
+}
+#endif
 
 // current source: https://en.wikipedia.org/wiki/Red%E2%80%93black_tree 
 // todo: I am sure that my implementation of Red-Black Tree is total bs, and there is a much better way to create self-balancing search tree, so TODO: check if there is a way to make it faster
@@ -87,7 +616,7 @@ enum RBT_Direction {
     RBT_RIGHT,
 };
 
-inline void RBT_ResetNode(AllocationNode *node) {
+static inline void RBT_ResetNode(AllocationNode *node) {
     node->left = 0;
     node->right = 0;
     node->previous = 0; 
@@ -96,7 +625,7 @@ inline void RBT_ResetNode(AllocationNode *node) {
     node->color = RBT_RED;
 }
 
-inline AllocationNode *RBT_RotateRight(AllocationNode *root, AllocationNode *first) {
+static inline AllocationNode *RBT_RotateRight(AllocationNode *root, AllocationNode *first) {
     AllocationNode *grandparent = first->parent;
     AllocationNode *second = first->left;
     assert(second);
@@ -124,7 +653,7 @@ inline AllocationNode *RBT_RotateRight(AllocationNode *root, AllocationNode *fir
     return root;
 }
 
-inline AllocationNode *RBT_RotateLeft(AllocationNode *root, AllocationNode *first) {
+static inline AllocationNode *RBT_RotateLeft(AllocationNode *root, AllocationNode *first) {
     AllocationNode *grandparent = first->parent;
     AllocationNode *second = first->right;
     assert(second);
@@ -152,6 +681,12 @@ inline AllocationNode *RBT_RotateLeft(AllocationNode *root, AllocationNode *firs
     return root;
 }
 
+// Tree is keyed by (size, address): chunks of the same size are ordered by address, so best fit always takes the lowest one
+// and allocations pack toward the beginning of the blocks, leaving the rest free for longer and letting trailing blocks drain
+static inline bool RBT_NodeLess(AllocationNode *first, AllocationNode *second) {
+    return first->size < second->size || (first->size == second->size && first < second);
+}
+
 static inline AllocationNode *RBT_AddNode(AllocationNode *parent, AllocationNode *new_node) {
     assert(new_node);
     assert(new_node->color == RBT_RED);
@@ -168,18 +703,8 @@ static inline AllocationNode *RBT_AddNode(AllocationNode *parent, AllocationNode
     AllocationNode *root = parent;
 
     while(true) {
-        if (parent->size == new_node->size) {
-            assert(parent != new_node && "One node is inserted multiple times");
-            if (parent->next) {
-                new_node->next = parent->next;
-                new_node->next->previous = new_node;
-            }
-
-            parent->next = new_node;
-            new_node->previous = parent;
-            return root;
-        }
-        if (parent->size > new_node->size) {
+        assert(parent != new_node && "One node is inserted multiple times");
+        if (RBT_NodeLess(new_node, parent)) {
             if (parent->left) {
                 parent = parent->left;
             } else {
@@ -273,7 +798,7 @@ static inline AllocationNode *RBT_AddNode(AllocationNode *parent, AllocationNode
 
 // note: second node should be deeper than first node or at least on the same level with it
 // there it no way to check it, thought, so this function might silently fail...
-inline AllocationNode *RBT_SwapNodes(AllocationNode *root, AllocationNode *first, AllocationNode *second) {
+static inline AllocationNode *RBT_SwapNodes(AllocationNode *root, AllocationNode *first, AllocationNode *second) {
     RBT_Direction second_dir;
     if (second->parent->left == second) {
         second_dir = RBT_LEFT;
@@ -566,79 +1091,20 @@ static inline AllocationNode *RBT_RemoveNode(AllocationNode *root, AllocationNod
     }
 }
 
-// todo: rename remove functions
-AllocationNode *RBT_RemoveSize(AllocationNode *root, AllocationNode *node) {
-    AllocationNode *previous = node->previous;
-    if (previous) {
-        assert(previous->next == node);
-        
-        previous->next = node->next;
-        if (previous->next) {
-            previous->next->previous = previous;
-        } 
-
-        return root;
-    }
-
-    AllocationNode *next = node->next;
-    if (next) {
-        next->color  = node->color;
-        next->left   = node->left;
-        if (next->left) {
-            next->left->parent = next;
-        }
-        next->right  = node->right;
-        if (next->right) {
-            next->right->parent = next;
-        }
-        next->previous = 0;
-
-        next->parent = node->parent;
-        if (!next->parent) {
-            assert(node == root);
-            return next;
-        }
-
-        if (next->parent->left == node) {
-            next->parent->left = next;
-        } else if (next->parent->right == node) {
-            next->parent->right = next;
-        } else {
-            assert(0);
-        }
-
-        return root;
-    }
-
-    return RBT_RemoveNode(root, node);
-}
-
+// returns the smallest chunk that can hold size bytes, the lowest one among chunks of that size
 AllocationNode *RBT_FindClosest(AllocationNode *root, int64_t size) {
-    if (!root) {
-        return 0;  
-    }
     AllocationNode *node    = root;
     AllocationNode *closest = 0;
-    while(true) {
-        assert(!node->occupied && "shouldn't see occupied node inside tree");
-        assert(!node->used_size && "shouldn't see occupied node inside tree");
-        if (node->size == size) {
-            return node;
-        } 
+    while(node) {
+        assert(!(node->size & ALLOCATION_NODE_OCCUPIED) && "shouldn't see occupied node inside tree");
         if (node->size < size) {
-            if (!node->right) {
-                return closest;
-            }
             node = node->right;
-        }
-        else {
+        } else {
             closest = node;
-            if (!node->left) {
-                return closest;
-            } 
             node = node->left;
         }
     } 
+    return closest;
 }
 
 #define PRINT(...) fprintf(stdout, __VA_ARGS__);
@@ -654,25 +1120,7 @@ void RBT_DumpNode(AllocationNode *node, int64_t indent) {
     fprintf(stdout, "%*s", (int)(indent), "");
     //PRINT_INDENT(indent);
 
-    int64_t count = 1;
-    AllocationNode *next = node->next;
-    if (node == next) {
-        count = -1;
-    } else {
-        while(true) {
-            if (!next) {
-                break;
-            }
-            if (next == next->next) {
-                count = -1;
-                break;
-            }
-            count += 1;
-            next = next->next;
-        }
-    }
-    
-    PRINT("%s(%lld, count=%lld, ptr=%p)\n", color_string, node->size, count, node);
+    PRINT("%s(%lld, ptr=%p)\n", color_string, node->size, node);
 
     if (node->left) {
         if (node == node->left) {
@@ -707,330 +1155,3262 @@ void RBT_Dump(AllocationNode *node) {
     RBT_DumpNode(node, 0);
 }
 
-inline AllocationNode *SkipMemoryBlockHeader(MemoryBlock *header) {
+static inline AllocationNode *SkipMemoryBlockHeader(MemoryBlock *header) {
     uint8_t *res = (uint8_t*)header;
     res += sizeof(MemoryBlock); 
     return (AllocationNode*)res;
 }
 
-inline void *SkipAllocationNode(AllocationNode *info) {
+static inline void *SkipAllocationNode(AllocationNode *info) {
     uint8_t *res = (uint8_t*)info;
-    res += sizeof(AllocationNode);
+    res += ALLOCATION_NODE_HEADER_SIZE;
     return res;
 }
 
-inline AllocationNode *GetAllocationNode(void *memory) {
-    return (AllocationNode*)((uint8_t*)memory - sizeof(AllocationNode));
+static inline AllocationNode *GetAllocationNode(void *memory) {
+    return (AllocationNode*)((uint8_t*)memory - ALLOCATION_NODE_HEADER_SIZE);
 }
 
-MemoryBlock *AllocateNewBlock(HeapArena *arena, int64_t size) { 
-    size = size + sizeof(MemoryBlock) + sizeof(AllocationNode);
-    if (NORMAL_ALLOCATION_SIZE > size) {
-        size = NORMAL_ALLOCATION_SIZE;
+static inline int64_t AllocationNodeSize(AllocationNode *node) {
+    return node->size & ~(int64_t)ALLOCATION_NODE_FLAGS;
+}
+
+static inline bool AllocationNodeOccupied(AllocationNode *node) {
+    return (node->size & ALLOCATION_NODE_OCCUPIED) != 0;
+}
+
+// note: every memory block ends with an occupied zero-sized chunk, so the last chunk of the block also has a valid next node
+static inline AllocationNode *GetNextNode(AllocationNode *node) {
+    uint8_t *res = (uint8_t*)SkipAllocationNode(node);
+    res += AllocationNodeSize(node);
+    return (AllocationNode*)res;
+}
+
+static inline AllocationNode *GetPreviousNode(AllocationNode *node) {
+    if (!node->previous_size) {
+        return 0;
     }
-   
-    MemoryBlock *res = PlatformGetMemory(size);
-    AllocationNode *info = SkipMemoryBlockHeader(res);
-    info->size = size - sizeof(MemoryBlock) - sizeof(AllocationNode);
-    info->memory_block = res;
+    uint8_t *res = (uint8_t*)node;
+    res -= node->previous_size + ALLOCATION_NODE_HEADER_SIZE;
+    return (AllocationNode*)res;
+}
 
-    arena->allocated_size += size;
-    arena->free_size += info->size;
-    return res;
+static_assert(
+    sizeof(MemoryBlock) % ALLOCATION_GRANULARITY == 0 && ALLOCATION_NODE_HEADER_SIZE % ALLOCATION_GRANULARITY == 0,
+    "Memory block and chunk headers should keep payloads aligned to ALLOCATION_GRANULARITY"
+);
+
+// rounds the size of a mapping up to a multiple of HEAP_ARENA_PAGE_SIZE, with ALLOCATORS_HUGE_PAGES mappings of at least
+// HEAP_ARENA_HUGE_PAGE_SIZE bytes are rounded up to a multiple of it instead, so they can be backed by huge pages
+static inline int64_t HeapArenaRoundToPages(int64_t size) {
+#ifdef ALLOCATORS_HUGE_PAGES
+    if (size >= HEAP_ARENA_HUGE_PAGE_SIZE) {
+        return (size + HEAP_ARENA_HUGE_PAGE_SIZE - 1) & ~(int64_t)(HEAP_ARENA_HUGE_PAGE_SIZE - 1);
+    }
+#endif
+    return (size + HEAP_ARENA_PAGE_SIZE - 1) & ~(int64_t)(HEAP_ARENA_PAGE_SIZE - 1);
 }
 
-// Note: the only reason these functions exist is because HeapArenaAllocate and HeapArenaReallocate share almost the same code, except that in cast of reallocation it should copy memory from the previous allocation, right in between these functions. If it weren't for this difference, these function would be merged with HeapArenaAllocate
-inline AllocationNode *HeapArenaGetNode(HeapArena *arena, int64_t size) {
-    AllocationNode *node = RBT_FindClosest(arena->root, size);
-    if (!node) {
-        MemoryBlock *block = AllocateNewBlock(arena, size);
-        assert(!arena->last_block->next);
-        arena->last_block->next = block;
-        arena->last_block = block;
+// note: value should be non zero
+static inline int64_t HeapHighestBit(uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long bit = 0;
+    _BitScanReverse64(&bit, (unsigned __int64)value);
+    return bit;
+#else
+    return 63 - __builtin_clzll((unsigned long long)value);
+#endif
+}
 
-        node = SkipMemoryBlockHeader(block);
+static inline int64_t HeapLowestBit(uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long bit = 0;
+    _BitScanForward64(&bit, (unsigned __int64)value);
+    return bit;
+#else
+    return __builtin_ctzll((unsigned long long)value);
+#endif
+}
 
-        node->previous_in_order = arena->last_node;
-        if (node->previous_in_order) {
-            node->previous_in_order->next_in_order = node;
-        }
-        arena->last_node = node;
-         
-        node->memory_block = block;
-        arena->root = RBT_AddNode(arena->root, node);
+static inline int64_t HeapStatsBucket(int64_t size) {
+    if (size <= 1) {
+        return 0;
     }
+    int64_t bucket = HeapHighestBit(size);
+    return bucket < HEAP_STATS_BUCKET_COUNT ? bucket : HEAP_STATS_BUCKET_COUNT - 1;
+}
 
-    node->occupied = true;
-    node->used_size = size;
-    arena->root = RBT_RemoveSize(arena->root, node);
-    RBT_ResetNode(node);
+static inline void HeapArenaStatsAllocate(HeapArena *arena, int64_t size) {
+    arena->live_size  += size;
+    arena->live_count += 1;
+    arena->live_histogram[HeapStatsBucket(size)] += 1;
+}
 
-    arena->free_size -= node->size;
-    return node;
+static inline void HeapArenaStatsFree(HeapArena *arena, int64_t size) {
+    arena->live_size  -= size;
+    arena->live_count -= 1;
+    arena->live_histogram[HeapStatsBucket(size)] -= 1;
 }
 
-inline void HeapArenaSeparateExtraMemory(HeapArena *arena, AllocationNode *node) {
-    int64_t free_size = node->size - node->used_size - sizeof(AllocationNode);
-    if (free_size <= 0) {
+#ifdef ALLOCATORS_TLSF
+static inline void HeapTLSFMapping(int64_t size, int64_t *first, int64_t *second) {
+    if (size < HEAP_TLSF_LINEAR_SIZE) {
+        *first  = 0;
+        *second = size / ALLOCATION_GRANULARITY;
         return;
     }
+    int64_t bit = HeapHighestBit(size);
+    *first  = bit - HEAP_TLSF_LINEAR_LOG2 + 1;
+    *second = (size >> (bit - HEAP_TLSF_SECOND_LEVEL_LOG2)) ^ HEAP_TLSF_SECOND_LEVEL_COUNT;
+}
 
-    uint8_t *memory = SkipAllocationNode(node);
-    memory += node->used_size;
- 
-    AllocationNode *next = (AllocationNode*)memory;
-    memset(next, 0, sizeof(AllocationNode)); 
+static inline void HeapTLSFAddNode(HeapArena *arena, AllocationNode *node) {
+    int64_t first = 0, second = 0;
+    HeapTLSFMapping(AllocationNodeSize(node), &first, &second);
 
-    node->size = node->used_size;
+    AllocationNode **list = &arena->free_lists[first][second];
+    node->previous = 0;
+    node->next = *list;
+    if (*list) {
+        (*list)->previous = node;
+    }
+    *list = node;
+    arena->free_first_level |= (uint64_t)1 << first;
+    arena->free_second_level[first] |= (uint32_t)1 << second;
+}
 
-    next->memory_block = node->memory_block;
-    next->size = free_size;
+static inline void HeapTLSFRemoveNode(HeapArena *arena, AllocationNode *node) {
+    int64_t first = 0, second = 0;
+    HeapTLSFMapping(AllocationNodeSize(node), &first, &second);
 
-    next->previous_in_order = node;
-    next->next_in_order     = node->next_in_order;
-    next->previous_in_order->next_in_order = next;
-    if (next->next_in_order) {
-        next->next_in_order->previous_in_order = next;
+    AllocationNode **list = &arena->free_lists[first][second];
+    if (node->previous) {
+        assert(node->previous->next == node);
+        node->previous->next = node->next;
+    } else {
+        assert(*list == node);
+        *list = node->next;
     }
-    if (arena->last_node == node) {
-        arena->last_node = next;
+    if (node->next) {
+        node->next->previous = node->previous;
     }
 
-    arena->root = RBT_AddNode(arena->root, next);
-    arena->free_size += free_size;
+    if (!*list) {
+        arena->free_second_level[first] &= ~((uint32_t)1 << second);
+        if (!arena->free_second_level[first]) {
+            arena->free_first_level &= ~((uint64_t)1 << first);
+        }
+    }
 }
 
-void *HeapArenaAllocate(HeapArena *arena, int64_t size) {
-    if (!arena->first_block) {
-        assert(!arena->last_block);    
-
-        arena->first_block = AllocateNewBlock(arena, size);
-        arena->last_block  = arena->first_block;
-
-        arena->root = SkipMemoryBlockHeader(arena->first_block);
-        arena->first_node = arena->root;
-        arena->last_node  = arena->root;
-    }     
-
-    AllocationNode *node = HeapArenaGetNode(arena, size);
-    HeapArenaSeparateExtraMemory(arena, node); 
-    void *res = SkipAllocationNode(node);
+// note: size is rounded up to the next class boundary, so the first chunk of any non empty class at or above it fits without looking at its size
+static inline AllocationNode *HeapTLSFFind(HeapArena *arena, int64_t size) {
+    if (size >= HEAP_TLSF_LINEAR_SIZE) {
+        size += ((int64_t)1 << (HeapHighestBit(size) - HEAP_TLSF_SECOND_LEVEL_LOG2)) - 1;
+    }
+    int64_t first = 0, second = 0;
+    HeapTLSFMapping(size, &first, &second);
+
+    uint32_t second_map = arena->free_second_level[first] & (~(uint32_t)0 << second);
+    if (!second_map) {
+        uint64_t first_map = first + 1 < HEAP_TLSF_FIRST_LEVEL_COUNT ? arena->free_first_level & (~(uint64_t)0 << (first + 1)) : 0;
+        if (!first_map) {
+            return 0;
+        }
+        first = HeapLowestBit(first_map);
+        second_map = arena->free_second_level[first];
+    }
+    second = HeapLowestBit(second_map);
+    return arena->free_lists[first][second];
+}
 
-    return res;
+// the largest chunk size that maps to the class, chunk sizes are multiples of ALLOCATION_GRANULARITY
+static inline int64_t HeapTLSFClassLimit(int64_t first, int64_t second) {
+    if (!first) {
+        return second * ALLOCATION_GRANULARITY;
+    }
+    int64_t shift = first + HEAP_TLSF_LINEAR_LOG2 - 1 - HEAP_TLSF_SECOND_LEVEL_LOG2;
+    return ((HEAP_TLSF_SECOND_LEVEL_COUNT + second + 1) << shift) - ALLOCATION_GRANULARITY;
 }
+#endif
 
-void HeapArenaFree(HeapArena *arena, void *memory) {
-    AllocationNode *info = GetAllocationNode(memory);
-    info->occupied = false;
-    info->used_size = 0;
+// Every change of the free index goes through these two, so free chunk statistics are always up to date
+static inline void HeapArenaAddFreeNode(HeapArena *arena, AllocationNode *node) {
+#ifdef ALLOCATORS_TLSF
+    HeapTLSFAddNode(arena, node);
+#else
+    arena->root = RBT_AddNode(arena->root, node);
+    if (AllocationNodeSize(node) > arena->largest_free_size) {
+        arena->largest_free_size = AllocationNodeSize(node);
+    }
+#endif
+    arena->free_chunk_count += 1;
+    arena->free_histogram[HeapStatsBucket(AllocationNodeSize(node))] += 1;
+}
+
+static inline void HeapArenaRemoveFreeNode(HeapArena *arena, AllocationNode *node) {
+    arena->free_chunk_count -= 1;
+    arena->free_histogram[HeapStatsBucket(AllocationNodeSize(node))] -= 1;
+#ifdef ALLOCATORS_TLSF
+    HeapTLSFRemoveNode(arena, node);
+#else
+    arena->root = RBT_RemoveNode(arena->root, node);
+    // note: chunks of the same size may stay in the tree, so the rightmost node is found again, it takes O(log n) like the removal itself
+    if (AllocationNodeSize(node) == arena->largest_free_size) {
+        AllocationNode *rightmost = arena->root;
+        while (rightmost && rightmost->right) {
+            rightmost = rightmost->right;
+        }
+        arena->largest_free_size = rightmost ? AllocationNodeSize(rightmost) : 0;
+    }
+#endif
+}
+
+// returns free chunk that can hold size bytes, or null if there is none
+static inline AllocationNode *HeapArenaFindFreeNode(HeapArena *arena, int64_t size) {
+#ifdef ALLOCATORS_TLSF
+    return HeapTLSFFind(arena, size);
+#else
+    return RBT_FindClosest(arena->root, size);
+#endif
+}
+
+static inline int64_t HeapArenaChunkSize(int64_t size) {
+    size = (size + ALLOCATION_GRANULARITY - 1) & ~(ALLOCATION_GRANULARITY - 1);
+    if (size < ALLOCATION_NODE_MIN_SIZE) {
+        size = ALLOCATION_NODE_MIN_SIZE;
+    }
+    return size;
+}
+
+// returns false if the block can't be added to the page map, then the arena isn't changed
+static inline bool HeapArenaInitBlock(HeapArena *arena, MemoryBlock *res, int64_t size) {
+#ifdef ALLOCATORS_THREAD_SAFE
+    if (!HeapPageMapSet(res, size, arena)) {
+        HeapPageMapSet(res, size, 0);
+        return false;
+    }
+#endif
+    res->next = 0;
+    res->size = size;
+
+    AllocationNode *info = SkipMemoryBlockHeader(res);
+    info->previous_size = 0;
+    info->size = size - sizeof(MemoryBlock) - 2*ALLOCATION_NODE_HEADER_SIZE;
+    RBT_ResetNode(info);
+
+    // note: terminating chunk is never freed, so chunks from the different blocks are never coalesced
+    AllocationNode *fence = GetNextNode(info);
+    fence->previous_size = info->size;
+    fence->size = ALLOCATION_NODE_OCCUPIED;
+
+    arena->allocated_size += size;
+    arena->free_size += info->size;
+    arena->block_count += 1;
+
+    if (arena->last_block) {
+        assert(!arena->last_block->next);
+        arena->last_block->next = res;
+    } else {
+        arena->first_block = res;
+    }
+    arena->last_block = res;
+    return true;
+}
+
+MemoryBlock *AllocateNewBlock(HeapArena *arena, int64_t size) { 
+    size = size + sizeof(MemoryBlock) + 2*ALLOCATION_NODE_HEADER_SIZE;
+    if (NORMAL_ALLOCATION_SIZE > size) {
+        size = NORMAL_ALLOCATION_SIZE;
+    }
+    size = HeapArenaRoundToPages(size);
+   
+    MemoryBlock *res = PlatformGetMemory(size);
+    if (!res) {
+        return 0;
+    }
+    assert(((uintptr_t)res & (ALLOCATION_GRANULARITY - 1)) == 0 && "PlatformGetMemory should return memory aligned at least to ALLOCATION_GRANULARITY");
+    if (!HeapArenaInitBlock(arena, res, size)) {
+        PlatformFreeMemory(res, size);
+        return 0;
+    }
+    return res;
+}
+
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+static inline AllocationNode *HeapArenaReservedFence(HeapArena *arena) {
+    MemoryBlock *block = arena->reserved_block;
+    return (AllocationNode*)((uint8_t*)block + block->size - ALLOCATION_NODE_HEADER_SIZE);
+}
+
+static inline bool HeapArenaIsReservedTail(HeapArena *arena, AllocationNode *node) {
+    return arena->reserved_block && GetNextNode(node) == HeapArenaReservedFence(arena);
+}
+
+// Commits more of the reserved range right after the block: the old fence becomes a free chunk, which coalesces with the free tail of the block.
+// Returns the free chunk that can hold size bytes, or null if the range can't grow
+static AllocationNode *HeapArenaGrowReserved(HeapArena *arena, int64_t size) {
+    if (arena->reserve_failed) {
+        return 0;
+    }
+    if (!arena->reserved_block) {
+        int64_t commit_size = size + sizeof(MemoryBlock) + 2*ALLOCATION_NODE_HEADER_SIZE;
+        commit_size = HeapArenaRoundToPages(commit_size > HEAP_ARENA_COMMIT_SIZE ? commit_size : HEAP_ARENA_COMMIT_SIZE);
+        if (commit_size > HEAP_ARENA_RESERVE_SIZE) {
+            return 0;
+        }
+        MemoryBlock *block = PlatformReserveMemory(HEAP_ARENA_RESERVE_SIZE);
+        if (!block || !PlatformCommitMemory(block, commit_size)) {
+            if (block) {
+                PlatformFreeMemory(block, HEAP_ARENA_RESERVE_SIZE);
+            }
+            arena->reserve_failed = true;
+            return 0;
+        }
+        if (!HeapArenaInitBlock(arena, block, commit_size)) {
+            PlatformFreeMemory(block, HEAP_ARENA_RESERVE_SIZE);
+            return 0;
+        }
+        arena->reserved_block = block;
+
+        AllocationNode *node = SkipMemoryBlockHeader(block);
+        HeapArenaAddFreeNode(arena, node);
+        return node;
+    }
+
+    MemoryBlock *block = arena->reserved_block;
+    AllocationNode *fence = HeapArenaReservedFence(arena);
+    AllocationNode *tail  = GetPreviousNode(fence);
+    int64_t needed_size = AllocationNodeOccupied(tail) ? size + ALLOCATION_NODE_HEADER_SIZE : size - tail->size;
+    int64_t grow_size   = HeapArenaRoundToPages(needed_size > HEAP_ARENA_COMMIT_SIZE ? needed_size : HEAP_ARENA_COMMIT_SIZE);
+    if (block->size + grow_size > HEAP_ARENA_RESERVE_SIZE) {
+        grow_size = HEAP_ARENA_RESERVE_SIZE - block->size;
+    }
+    if (grow_size < needed_size || !PlatformCommitMemory((uint8_t*)block + block->size, grow_size)) {
+        return 0;
+    }
+#ifdef ALLOCATORS_THREAD_SAFE
+    if (!HeapPageMapSet((uint8_t*)block + block->size, grow_size, arena)) {
+        HeapPageMapSet((uint8_t*)block + block->size, grow_size, 0);
+        PlatformDecommitMemory((uint8_t*)block + block->size, grow_size);
+        return 0;
+    }
+#endif
+    block->size += grow_size;
+    arena->allocated_size += grow_size;
+
+    AllocationNode *node = fence;
+    node->size = grow_size - ALLOCATION_NODE_HEADER_SIZE;
+    RBT_ResetNode(node);
+    arena->free_size += node->size;
+
+    fence = GetNextNode(node);
+    fence->previous_size = node->size;
+    fence->size = ALLOCATION_NODE_OCCUPIED;
+
+    if (!AllocationNodeOccupied(tail)) {
+        HeapArenaRemoveFreeNode(arena, tail);
+        RBT_ResetNode(tail);
+        arena->free_size += ALLOCATION_NODE_HEADER_SIZE;
+        tail->size = tail->size + ALLOCATION_NODE_HEADER_SIZE + node->size;
+        fence->previous_size = tail->size;
+        node = tail;
+    }
+    HeapArenaAddFreeNode(arena, node);
+    return node;
+}
+
+// Decommits free tail of the reserved block, so at most keep_bytes stay free in the whole arena. Returns how many bytes were decommitted
+static int64_t HeapArenaShrinkReserved(HeapArena *arena, int64_t keep_bytes) {
+    if (!arena->reserved_block) {
+        return 0;
+    }
+    MemoryBlock *block = arena->reserved_block;
+    AllocationNode *tail = GetPreviousNode(HeapArenaReservedFence(arena));
+    if (AllocationNodeOccupied(tail)) {
+        return 0;
+    }
+
+    // note: tail chunk stays, even if it is the only one in the block, so the block never has to be rebuilt
+    int64_t keep_size = keep_bytes - (arena->free_size - tail->size);
+    if (keep_size < ALLOCATION_NODE_MIN_SIZE) {
+        keep_size = ALLOCATION_NODE_MIN_SIZE;
+    }
+    int64_t new_size = HeapArenaRoundToPages((uint8_t*)SkipAllocationNode(tail) - (uint8_t*)block + keep_size + ALLOCATION_NODE_HEADER_SIZE);
+    if (new_size >= block->size) {
+        return 0;
+    }
+    int64_t released_size = block->size - new_size;
+
+    HeapArenaRemoveFreeNode(arena, tail);
+    RBT_ResetNode(tail);
+    tail->size -= released_size;
+    arena->free_size -= released_size;
+    HeapArenaAddFreeNode(arena, tail);
+
+    AllocationNode *fence = GetNextNode(tail);
+    fence->previous_size = tail->size;
+    fence->size = ALLOCATION_NODE_OCCUPIED;
+
+#ifdef ALLOCATORS_THREAD_SAFE
+    HeapPageMapSet((uint8_t*)block + new_size, released_size, 0);
+#endif
+    PlatformDecommitMemory((uint8_t*)block + new_size, released_size);
+    block->size = new_size;
+    arena->allocated_size -= released_size;
+    return released_size;
+}
+#endif
+
+#if HEAP_QUICK_LIST_DEPTH
+static void HeapQuickListFlushAll(HeapArena *arena);
+#endif
+
+// Note: size should be already rounded by HeapArenaChunkSize
+static inline AllocationNode *HeapArenaGetNode(HeapArena *arena, int64_t size) {
+    AllocationNode *node = HeapArenaFindFreeNode(arena, size);
+#if HEAP_QUICK_LIST_DEPTH
+    // note: cached chunks may coalesce into the one that fits, so they are flushed before the arena grows
+    if (!node && arena->quick_size) {
+        HeapQuickListFlushAll(arena);
+        node = HeapArenaFindFreeNode(arena, size);
+    }
+#endif
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+    if (!node) {
+        node = HeapArenaGrowReserved(arena, size);
+    }
+#endif
+    if (!node) {
+        MemoryBlock *block = AllocateNewBlock(arena, size);
+        if (!block) {
+            return 0;
+        }
+        node = SkipMemoryBlockHeader(block);
+        HeapArenaAddFreeNode(arena, node);
+    }
+
+    HeapArenaRemoveFreeNode(arena, node);
+    arena->free_size -= node->size;
+    node->size |= ALLOCATION_NODE_OCCUPIED;
+    return node;
+}
+
+static inline void HeapArenaSeparateExtraMemory(HeapArena *arena, AllocationNode *node, int64_t size) {
+    int64_t free_size = AllocationNodeSize(node) - size - ALLOCATION_NODE_HEADER_SIZE;
+    if (free_size < ALLOCATION_NODE_MIN_SIZE) {
+        return;
+    }
+
+    node->size = size | ALLOCATION_NODE_OCCUPIED;
+ 
+    AllocationNode *next = GetNextNode(node);
+    next->previous_size = size;
+    next->size = free_size;
+    RBT_ResetNode(next);
+    GetNextNode(next)->previous_size = free_size;
+
+    HeapArenaAddFreeNode(arena, next);
+    arena->free_size += free_size;
+}
+
+static inline AllocationNode *HeapArenaAllocateChunk(HeapArena *arena, int64_t size) {
+    size = HeapArenaChunkSize(size);
+
+    AllocationNode *node = HeapArenaGetNode(arena, size);
+    if (!node) {
+        return 0;
+    }
+    HeapArenaSeparateExtraMemory(arena, node, size); 
+    return node;
+}
+
+// note: chunks past into up to last stop being chunks when they are merged into it, so incremental validation checks into instead of them
+static inline void HeapArenaValidateMerge(HeapArena *arena, AllocationNode *into, AllocationNode *last) {
+    if (arena->validate_node > into && arena->validate_node <= last) {
+        arena->validate_node = into;
+    }
+}
+
+static inline void HeapArenaFreeChunk(HeapArena *arena, AllocationNode *info) {
+    assert(AllocationNodeOccupied(info) && "Memory is already free");
+    info->size &= ~(int64_t)ALLOCATION_NODE_OCCUPIED;
     arena->free_size += info->size;
+    arena->freed_since_trim += info->size;
+    RBT_ResetNode(info);
+
+    AllocationNode *next = GetNextNode(info);
+    if (!AllocationNodeOccupied(next)) {
+        HeapArenaRemoveFreeNode(arena, next);
+        arena->free_size += ALLOCATION_NODE_HEADER_SIZE;
+        info->size = info->size + ALLOCATION_NODE_HEADER_SIZE + next->size;
+        GetNextNode(info)->previous_size = info->size;
+        HeapArenaValidateMerge(arena, info, next);
+    } 
+
+    AllocationNode *previous = GetPreviousNode(info);
+    if (previous && !AllocationNodeOccupied(previous)) {
+        HeapArenaRemoveFreeNode(arena, previous);
+        RBT_ResetNode(previous);
+        arena->free_size += ALLOCATION_NODE_HEADER_SIZE;
+        previous->size = previous->size + ALLOCATION_NODE_HEADER_SIZE + info->size;
+        GetNextNode(previous)->previous_size = previous->size;
+        HeapArenaValidateMerge(arena, previous, info);
+        info = previous;
+    } 
+
+    HeapArenaAddFreeNode(arena, info);
+
+#if HEAP_ARENA_TRIM_THRESHOLD
+    bool block_is_free = !info->previous_size && !AllocationNodeSize(GetNextNode(info));
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+    // note: reserved block is never released, but its free tail is decommitted in the same way
+    block_is_free = block_is_free || HeapArenaIsReservedTail(arena, info);
+#endif
+    // note: free memory may be spread over blocks that are still in use, then trim can't go below the threshold and
+    // without this limit every block that becomes free would start another walk over all blocks
+    if (block_is_free && arena->free_size > HEAP_ARENA_TRIM_THRESHOLD && arena->freed_since_trim > HEAP_ARENA_TRIM_THRESHOLD / 2) {
+        arena->freed_since_trim = 0;
+        HeapArenaTrim(arena, HEAP_ARENA_TRIM_THRESHOLD / 2);
+    }
+#endif
+}
+
+#if HEAP_QUICK_LIST_DEPTH
+// returns -1 if chunks of this size aren't cached
+static inline int64_t HeapQuickListIndex(int64_t chunk_size) {
+    if (chunk_size <= HEAP_SLAB_MAX_SIZE || chunk_size > HEAP_QUICK_LIST_MAX_SIZE) {
+        return -1;
+    }
+    return (chunk_size - HEAP_SLAB_MAX_SIZE) / ALLOCATION_GRANULARITY - 1;
+}
+
+// note: list is detached before its chunks are freed, freeing may start automatic trim, which flushes every list again
+static void HeapQuickListFlush(HeapArena *arena, int64_t index) {
+    AllocationNode *node = arena->quick_lists[index];
+    arena->quick_lists[index] = 0;
+    arena->quick_counts[index] = 0;
+    while (node) {
+        AllocationNode *next = node->next;
+        arena->quick_size -= AllocationNodeSize(node);
+        HeapArenaFreeChunk(arena, node);
+        node = next;
+    }
+}
+
+static void HeapQuickListFlushAll(HeapArena *arena) {
+    for (int64_t i = 0; i < HEAP_QUICK_LIST_COUNT && arena->quick_size; ++i) {
+        if (arena->quick_lists[i]) {
+            HeapQuickListFlush(arena, i);
+        }
+    }
+}
+
+static inline AllocationNode *HeapQuickListPop(HeapArena *arena, int64_t chunk_size) {
+    int64_t index = HeapQuickListIndex(chunk_size);
+    if (index < 0 || !arena->quick_lists[index]) {
+        return 0;
+    }
+    AllocationNode *node = arena->quick_lists[index];
+    arena->quick_lists[index] = node->next;
+    arena->quick_counts[index] -= 1;
+    arena->quick_size -= chunk_size;
+    return node;
+}
+
+// returns false if chunks of this size aren't cached, then the chunk should be freed as usual
+static inline bool HeapQuickListPush(HeapArena *arena, AllocationNode *node) {
+    int64_t index = HeapQuickListIndex(AllocationNodeSize(node));
+    if (index < 0) {
+        return false;
+    }
+#ifndef NDEBUG
+    // note: cached chunks stay occupied, so freeing one of them again is caught only here, list holds at most HEAP_QUICK_LIST_DEPTH chunks
+    for (AllocationNode *cached = arena->quick_lists[index]; cached; cached = cached->next) {
+        assert(cached != node && "Memory is already free");
+    }
+#endif
+    if (arena->quick_counts[index] == HEAP_QUICK_LIST_DEPTH) {
+        HeapQuickListFlush(arena, index);
+    }
+    node->next = arena->quick_lists[index];
+    arena->quick_lists[index] = node;
+    arena->quick_counts[index] += 1;
+    arena->quick_size += AllocationNodeSize(node);
+    return true;
+}
+#endif
+
+// Small allocations are served from slabs: occupied chunks of HEAP_SLAB_SIZE bytes, cut into equally sized slots.
+// Each slot starts with a tag that points to its slab, tag has HEAP_SLAB_TAG bit set, which is always zero in the size of a regular chunk,
+// that is how HeapArenaFree tells them apart 
+#ifndef HEAP_SLAB_SIZE
+#define HEAP_SLAB_SIZE 16*1024
+#endif
+
+#define HEAP_SLAB_TAG      2
+#define HEAP_SLAB_TAG_SIZE ((int64_t)sizeof(uintptr_t))
+
+struct HeapSlab {
+    HeapArena *arena;
+    HeapSlab *next; // slabs of the same class that have free slots
+    HeapSlab *previous;
+    void     *free_list; // freed slots, next pointer is stored in the slot itself
+    uint8_t  *cursor; // slots past the cursor were never used
+    uint8_t  *end;
+    int64_t  slot_size; // including tag
+    int64_t  class_index;
+    int64_t  used_count;
+    int64_t  capacity;
+};
+
+// note: slots are multiples of ALLOCATION_GRANULARITY and payload follows the tag, so every class is 8 bytes smaller than a multiple of 16
+static const int64_t HEAP_SLAB_CLASS_SIZES[HEAP_SLAB_CLASS_COUNT] = {
+      8,  24,  40,  56,  72,  88, 104, 120,
+    136, 152, 168, 184, 200, 216, 232, 248,
+    264, 328, 392, 456, 520,
+};
+
+static inline int64_t HeapSlabClassIndex(int64_t size) {
+    assert(size <= HEAP_SLAB_MAX_SIZE);
+    if (size <= 0) {
+        return 0;
+    }
+    if (size <= 264) {
+        return (size + 7) >> 4;
+    }
+    return 17 + ((size - 265) >> 6);
+}
+
+static inline HeapSlab *HeapSlabFromMemory(void *memory) {
+    uintptr_t tag = ((uintptr_t*)memory)[-1];
+    return (HeapSlab*)(tag & ~(uintptr_t)ALLOCATION_NODE_FLAGS);
+}
+
+static inline bool HeapArenaIsSlabMemory(void *memory) {
+    uintptr_t tag = ((uintptr_t*)memory)[-1];
+    return (tag & HEAP_SLAB_TAG) != 0;
+}
+
+static inline void HeapSlabUnlink(HeapArena *arena, HeapSlab *slab) {
+    if (slab->previous) {
+        slab->previous->next = slab->next;
+    } else {
+        assert(arena->slabs[slab->class_index] == slab);
+        arena->slabs[slab->class_index] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->previous = slab->previous;
+    }
+    slab->next = 0;
+    slab->previous = 0;
+}
+
+static inline void HeapSlabPush(HeapArena *arena, HeapSlab *slab) {
+    slab->previous = 0;
+    slab->next = arena->slabs[slab->class_index];
+    if (slab->next) {
+        slab->next->previous = slab;
+    }
+    arena->slabs[slab->class_index] = slab;
+}
+
+static inline HeapSlab *HeapSlabCreate(HeapArena *arena, int64_t class_index) {
+    AllocationNode *node = HeapArenaAllocateChunk(arena, HEAP_SLAB_SIZE);
+    if (!node) {
+        return 0;
+    }
+    HeapSlab *slab = SkipAllocationNode(node);
+    memset(slab, 0, sizeof(HeapSlab));
+
+    slab->arena       = arena;
+    slab->slot_size   = HEAP_SLAB_CLASS_SIZES[class_index] + HEAP_SLAB_TAG_SIZE;
+    slab->class_index = class_index;
+    slab->cursor      = (uint8_t*)slab + sizeof(HeapSlab);
+    slab->cursor     += ALLOCATION_GRANULARITY - HEAP_SLAB_TAG_SIZE - ((uintptr_t)slab->cursor & (ALLOCATION_GRANULARITY - 1));
+    slab->end         = (uint8_t*)slab + AllocationNodeSize(node);
+    slab->capacity    = (slab->end - slab->cursor) / slab->slot_size;
+    assert(slab->capacity > 0 && "HEAP_SLAB_SIZE is too small for the largest size class");
+
+    HeapSlabPush(arena, slab);
+    return slab;
+}
+
+static inline void *HeapSlabAllocate(HeapArena *arena, int64_t size) {
+    int64_t class_index = HeapSlabClassIndex(size);
+    HeapSlab *slab = arena->slabs[class_index];
+    if (!slab) {
+        slab = HeapSlabCreate(arena, class_index);
+        if (!slab) {
+            return 0;
+        }
+    }
+
+    void *res = slab->free_list;
+    if (res) {
+        slab->free_list = *(void**)res;
+    } else {
+        uintptr_t *tag = (uintptr_t*)slab->cursor;
+        *tag = (uintptr_t)slab | HEAP_SLAB_TAG;
+        res = slab->cursor + HEAP_SLAB_TAG_SIZE;
+        slab->cursor += slab->slot_size;
+    }
+
+    slab->used_count += 1;
+    if (slab->used_count == slab->capacity) {
+        HeapSlabUnlink(arena, slab);
+    }
+    HeapArenaStatsAllocate(arena, slab->slot_size - HEAP_SLAB_TAG_SIZE);
+    return res;
+}
+
+static inline void HeapSlabFree(HeapArena *arena, void *memory) {
+    HeapSlab *slab = HeapSlabFromMemory(memory);
+    assert(slab->used_count > 0);
+    HeapArenaStatsFree(arena, slab->slot_size - HEAP_SLAB_TAG_SIZE);
+
+    if (slab->used_count == slab->capacity) {
+        HeapSlabPush(arena, slab);
+    }
+    slab->used_count -= 1;
+    *(void**)memory = slab->free_list;
+    slab->free_list = memory;
+
+    // note: the last slab of the class is kept even if it is empty, so alternating allocation and free of a single object doesn't go to the tree every time
+    if (!slab->used_count && (slab->next || slab->previous)) {
+        HeapSlabUnlink(arena, slab);
+        HeapArenaFreeChunk(arena, GetAllocationNode(slab));
+    }
+}
+
+static inline HeapLargeAllocation *HeapLargeFromMemory(void *memory) {
+    return (HeapLargeAllocation*)memory - 1;
+}
+
+static inline bool HeapArenaIsLargeMemory(void *memory) {
+    int64_t tag = ((int64_t*)memory)[-1];
+    return (tag & ALLOCATION_NODE_LARGE) != 0;
+}
+
+// bytes from the start of the mapping to the payload
+static inline int64_t HeapLargeOffset(HeapLargeAllocation *large) {
+    return (uint8_t*)(large + 1) - large->mapping;
+}
+
+// note: mapping may be moved by the platform, so its neighbours are relinked every time
+static inline void *HeapLargeLink(HeapArena *arena, HeapLargeAllocation *large, uint8_t *mapping, int64_t mapped_size) {
+    large->mapping = mapping;
+    large->mapped_size = mapped_size;
+    large->size = (mapped_size - HeapLargeOffset(large)) | ALLOCATION_NODE_OCCUPIED | ALLOCATION_NODE_LARGE;
+    if (large->previous) {
+        large->previous->next = large;
+    } else {
+        arena->large_allocations = large;
+    }
+    if (large->next) {
+        large->next->previous = large;
+    }
+#ifdef ALLOCATORS_THREAD_SAFE
+    // note: memory is always freed by the pointer to the payload, so only its first page is mapped. HeapLargeAllocate maps it before
+    // the link, only a mapping moved by the platform may land where the page map has no leaf yet, and then it can't be moved back
+    bool mapped = HeapPageMapSet(large + 1, 1, arena);
+    assert(mapped && "Page map has no memory for the moved allocation");
+    (void)mapped;
+#endif
+    return large + 1;
+}
+
+// note: payload is aligned inside the mapping, so any alignment costs at most alignment bytes of the mapping
+static inline void *HeapLargeAllocate(HeapArena *arena, int64_t size, int64_t alignment) {
+    // note: no platform can map this much, the check keeps the rounding below from overflowing
+    if (size > INT64_MAX / 2 || alignment > INT64_MAX / 4) {
+        return 0;
+    }
+    int64_t mapped_size = HeapArenaRoundToPages(sizeof(HeapLargeAllocation) + alignment - 1 + size);
+    uint8_t *mapping = PlatformGetMemory(mapped_size);
+    if (!mapping) {
+        return 0;
+    }
+    assert(((uintptr_t)mapping & (ALLOCATION_GRANULARITY - 1)) == 0 && "PlatformGetMemory should return memory aligned at least to ALLOCATION_GRANULARITY");
+
+    uintptr_t payload = ((uintptr_t)mapping + sizeof(HeapLargeAllocation) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+#ifdef ALLOCATORS_THREAD_SAFE
+    if (!HeapPageMapSet((void*)payload, 1, arena)) {
+        PlatformFreeMemory(mapping, mapped_size);
+        return 0;
+    }
+#endif
+    HeapLargeAllocation *large = (HeapLargeAllocation*)payload - 1;
+    large->previous = 0;
+    large->next = arena->large_allocations;
+    arena->allocated_size += mapped_size;
+    arena->large_count += 1;
+    void *memory = HeapLargeLink(arena, large, mapping, mapped_size);
+    HeapArenaStatsAllocate(arena, mapped_size - HeapLargeOffset(large));
+    return memory;
+}
+
+static inline void HeapLargeFree(HeapArena *arena, void *memory) {
+    HeapLargeAllocation *large = HeapLargeFromMemory(memory);
+    if (large->previous) {
+        large->previous->next = large->next;
+    } else {
+        assert(arena->large_allocations == large);
+        arena->large_allocations = large->next;
+    }
+    if (large->next) {
+        large->next->previous = large->previous;
+    }
+    arena->allocated_size -= large->mapped_size;
+    arena->large_count -= 1;
+    HeapArenaStatsFree(arena, large->mapped_size - HeapLargeOffset(large));
+
+#ifdef ALLOCATORS_THREAD_SAFE
+    HeapPageMapSet(memory, 1, 0);
+#endif
+    PlatformFreeMemory(large->mapping, large->mapped_size);
+}
+
+// returns 0 if allocation should be moved
+static inline void *HeapLargeResize(HeapArena *arena, void *memory, int64_t new_size) {
+    HeapLargeAllocation *large = HeapLargeFromMemory(memory);
+    int64_t offset = HeapLargeOffset(large);
+    int64_t old_mapped_size = large->mapped_size;
+    int64_t new_mapped_size = HeapArenaRoundToPages(offset + new_size);
+    if (new_mapped_size == old_mapped_size) {
+        return memory;
+    }
+
+#ifdef ALLOCATORS_PLATFORM_RESIZE
+    // note: header moves with the mapping, so the old one can't be read after the resize
+    uint8_t *mapping = large->mapping;
+#ifdef ALLOCATORS_THREAD_SAFE
+    // note: once the mapping moves another thread can map the old pages, so their owner is cleared before
+    HeapPageMapSet(memory, 1, 0);
+#endif
+    uint8_t *resized = PlatformResizeMemory(mapping, old_mapped_size, new_mapped_size);
+#ifdef ALLOCATORS_THREAD_SAFE
+    if (!resized) {
+        bool mapped = HeapPageMapSet(memory, 1, arena);
+        assert(mapped && "Page map leaf of the allocation is gone");
+        (void)mapped;
+    }
+#endif
+    if (resized) {
+        arena->allocated_size += new_mapped_size - old_mapped_size;
+        HeapArenaStatsFree(arena, old_mapped_size - offset);
+        HeapArenaStatsAllocate(arena, new_mapped_size - offset);
+        return HeapLargeLink(arena, (HeapLargeAllocation*)(resized + offset) - 1, resized, new_mapped_size);
+    }
+#else
+    (void)arena;
+#endif
+
+// note: without the platform support shrinking keeps the whole mapping, it is cheaper than copying
+    if (new_mapped_size < old_mapped_size) {
+        return memory;
+    }
+    return 0;
+}
+
+// note: with tracing or profiling public functions are compiled under these names, so the calls they make to each other are not seen twice,
+// public versions that call the hooks are defined after HeapArenaRealloc. In debug mode they are compiled as the core, which never sees
+// the user pointers, checked versions are defined on top of it under the same names
+#if defined(ALLOCATORS_DEBUG)
+#define HeapArenaAllocate        HeapArenaAllocateCore
+#define HeapArenaAllocateAligned HeapArenaAllocateAlignedCore
+#define HeapArenaAllocateZeroed  HeapArenaAllocateZeroedCore
+#define HeapArenaRealloc         HeapArenaReallocCore
+#define HeapArenaFree            HeapArenaFreeCore
+#define HeapArenaAllocateBatch   HeapArenaAllocateBatchCore
+#define HeapArenaFreeBatch       HeapArenaFreeBatchCore
+#define HeapArenaUsableSize      HeapArenaUsableSizeCore
+#elif defined(ALLOCATORS_TRACE) || defined(ALLOCATORS_PROFILE)
+#define HeapArenaAllocate        HeapArenaAllocateInternal
+#define HeapArenaAllocateAligned HeapArenaAllocateAlignedInternal
+#define HeapArenaAllocateZeroed  HeapArenaAllocateZeroedInternal
+#define HeapArenaRealloc         HeapArenaReallocInternal
+#define HeapArenaFree            HeapArenaFreeInternal
+#define HeapArenaAllocateBatch   HeapArenaAllocateBatchInternal
+#define HeapArenaFreeBatch       HeapArenaFreeBatchInternal
+#endif
+
+void *HeapArenaAllocate(HeapArena *arena, int64_t size) {
+    if (size <= HEAP_SLAB_MAX_SIZE) {
+        return HeapSlabAllocate(arena, size);
+    }
+    if (size >= HEAP_ARENA_LARGE_ALLOCATION_SIZE) {
+        return HeapLargeAllocate(arena, size, ALLOCATION_GRANULARITY);
+    }
+
+    AllocationNode *node = 0;
+#if HEAP_QUICK_LIST_DEPTH
+    node = HeapQuickListPop(arena, HeapArenaChunkSize(size));
+#endif
+    if (!node) {
+        node = HeapArenaAllocateChunk(arena, size);
+        if (!node) {
+            return 0;
+        }
+    }
+    HeapArenaStatsAllocate(arena, AllocationNodeSize(node));
+    return SkipAllocationNode(node);
+}
+
+void *HeapArenaAllocateAligned(HeapArena *arena, int64_t size, int64_t alignment) {
+    assert(alignment > 0 && !(alignment & (alignment - 1)) && "Alignment should be a power of two");
+    if (alignment <= ALLOCATION_GRANULARITY) {
+        return HeapArenaAllocate(arena, size);
+    }
+    // note: large memory should be given back and resized by the platform, whatever its alignment is
+    if (size >= HEAP_ARENA_LARGE_ALLOCATION_SIZE) {
+        return HeapLargeAllocate(arena, size, alignment);
+    }
+
+    // note: we don't know where the chunk is going to be until we find it, so we ask for the worst case:
+    // enough space to move the payload forward by up to alignment bytes, leaving a free chunk in front of it
+    size = HeapArenaChunkSize(size);
+    int64_t padded_size = size + alignment + ALLOCATION_NODE_HEADER_SIZE + ALLOCATION_NODE_MIN_SIZE;
+    AllocationNode *node = HeapArenaGetNode(arena, padded_size);
+    if (!node) {
+        return 0;
+    }
+
+    uintptr_t payload = (uintptr_t)SkipAllocationNode(node);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != payload) {
+        while (aligned - payload < (uintptr_t)(ALLOCATION_NODE_HEADER_SIZE + ALLOCATION_NODE_MIN_SIZE)) {
+            aligned += alignment;
+        }
+
+        // padding goes back to the tree as a free chunk, its previous neighbour is occupied, because free chunks are always coalesced
+        int64_t padding_size = (int64_t)(aligned - payload) - ALLOCATION_NODE_HEADER_SIZE;
+        int64_t rest_size    = AllocationNodeSize(node) - padding_size - ALLOCATION_NODE_HEADER_SIZE;
+
+        AllocationNode *padding = node;
+        padding->size = padding_size;
+        RBT_ResetNode(padding);
+
+        node = GetAllocationNode((void*)aligned);
+        node->previous_size = padding_size;
+        node->size = rest_size | ALLOCATION_NODE_OCCUPIED;
+        GetNextNode(node)->previous_size = rest_size;
+
+        HeapArenaAddFreeNode(arena, padding);
+        arena->free_size += padding_size;
+    }
+
+    HeapArenaSeparateExtraMemory(arena, node, size);
+    HeapArenaStatsAllocate(arena, AllocationNodeSize(node));
+    return SkipAllocationNode(node);
+}
+
+void HeapArenaFree(HeapArena *arena, void *memory) {
+    if (HeapArenaIsSlabMemory(memory)) {
+        HeapSlabFree(arena, memory);
+        return;
+    }
+    if (HeapArenaIsLargeMemory(memory)) {
+        HeapLargeFree(arena, memory);
+        return;
+    }
+
+    AllocationNode *node = GetAllocationNode(memory);
+    HeapArenaStatsFree(arena, AllocationNodeSize(node));
+#if HEAP_QUICK_LIST_DEPTH
+    if (HeapQuickListPush(arena, node)) {
+        return;
+    }
+#endif
+    HeapArenaFreeChunk(arena, node);
+}
+
+// returns how many bytes can be used by the user, it may be larger than requested
+int64_t HeapArenaUsableSize(void *memory) {
+    if (HeapArenaIsSlabMemory(memory)) {
+        return HeapSlabFromMemory(memory)->slot_size - HEAP_SLAB_TAG_SIZE;
+    }
+    // note: large allocations keep their size in the same place as chunks
+    return AllocationNodeSize(GetAllocationNode(memory));
+}
+
+// Resizes occupied chunk without moving it: shrinking gives the tail to the next chunk or splits it off,
+// growing takes as much as needed from the next chunk if it is free. Returns false if chunk can't grow in place
+static inline bool HeapArenaResizeChunk(HeapArena *arena, AllocationNode *node, int64_t size) {
+    int64_t old_size = AllocationNodeSize(node);
+    AllocationNode *next = GetNextNode(node);
+    bool next_is_free = !AllocationNodeOccupied(next);
+
+    if (size > old_size) {
+        if (!next_is_free || old_size + ALLOCATION_NODE_HEADER_SIZE + next->size < size) {
+            return false;
+        }
+        HeapArenaRemoveFreeNode(arena, next);
+        arena->free_size -= next->size;
+
+        int64_t merged_size = old_size + ALLOCATION_NODE_HEADER_SIZE + next->size;
+        node->size = merged_size | ALLOCATION_NODE_OCCUPIED;
+        GetNextNode(node)->previous_size = merged_size;
+        HeapArenaValidateMerge(arena, node, next);
+
+        HeapArenaSeparateExtraMemory(arena, node, size);
+        return true;
+    }
+
+    if (size == old_size) {
+        return true;
+    }
+
+    if (!next_is_free) {
+        HeapArenaSeparateExtraMemory(arena, node, size);
+        return true;
+    }
+
+    // note: free neighbour just starts earlier, so even the tail that is too small to become a chunk isn't wasted
+    int64_t extra_size = old_size - size;
+    int64_t next_size  = next->size + extra_size;
+    HeapArenaRemoveFreeNode(arena, next);
+
+    AllocationNode *old_next = next;
+    node->size = size | ALLOCATION_NODE_OCCUPIED;
+    next = GetNextNode(node);
+    next->previous_size = size;
+    next->size = next_size;
+    RBT_ResetNode(next);
+    GetNextNode(next)->previous_size = next_size;
+    HeapArenaValidateMerge(arena, next, old_next);
+
+    HeapArenaAddFreeNode(arena, next);
+    arena->free_size += extra_size;
+    return true;
+}
+
+// Copy and fill kernels: SSE2 is always there on x86-64, AVX2 is picked at runtime if the cpu supports it.
+// Copies larger than HEAP_ARENA_STREAMING_THRESHOLD use non-temporal stores, so moving a huge buffer doesn't evict the whole cache
+#ifndef HEAP_ARENA_STREAMING_THRESHOLD
+#define HEAP_ARENA_STREAMING_THRESHOLD 4*1024*1024
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ALLOCATORS_X64
+#include "immintrin.h"
+#if defined(_MSC_VER) && !defined(__clang__)
+#include "intrin.h"
+#define ALLOCATORS_TARGET_AVX2
+#else
+#define ALLOCATORS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef enum HeapArenaKernel HeapArenaKernel;
+enum HeapArenaKernel {
+    HEAP_ARENA_KERNEL_UNKNOWN,
+    HEAP_ARENA_KERNEL_SSE2,
+    HEAP_ARENA_KERNEL_AVX2,
+};
+
+#if defined(_MSC_VER) && !defined(__clang__)
+// note: every thread detects the same kernel, so racing on this variable is harmless
+static volatile HeapArenaKernel heap_arena_kernel;
+
+static HeapArenaKernel HeapArenaDetectKernel(void) {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return HEAP_ARENA_KERNEL_SSE2;
+    }
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+    if (!os_saves_ymm) {
+        return HEAP_ARENA_KERNEL_SSE2;
+    }
+    __cpuidex(info, 7, 0);
+    if (info[1] & (1 << 5)) {
+        return HEAP_ARENA_KERNEL_AVX2;
+    }
+    return HEAP_ARENA_KERNEL_SSE2;
+}
+
+static inline HeapArenaKernel HeapArenaGetKernel(void) {
+    HeapArenaKernel kernel = heap_arena_kernel;
+    if (kernel == HEAP_ARENA_KERNEL_UNKNOWN) {
+        kernel = HeapArenaDetectKernel();
+        heap_arena_kernel = kernel;
+    }
+    return kernel;
+}
+#else
+// note: cpu model is filled by the runtime before main, so checking it is just a load
+static inline HeapArenaKernel HeapArenaGetKernel(void) {
+    if (__builtin_cpu_supports("avx2")) {
+        return HEAP_ARENA_KERNEL_AVX2;
+    }
+    return HEAP_ARENA_KERNEL_SSE2;
+}
+#endif
+
+// note: both kernels copy forward, so they can be used only if dest doesn't overlap the source from above
+static void HeapArenaCopySSE2(uint8_t *to, uint8_t *from, int64_t size, bool stream) {
+    while (size && ((uintptr_t)to & 15)) {
+        *to++ = *from++;
+        size -= 1;
+    }
+
+    if (stream) {
+        for (; size >= 64; size -= 64, to += 64, from += 64) {
+            __m128i a = _mm_loadu_si128((__m128i*)(from +  0));
+            __m128i b = _mm_loadu_si128((__m128i*)(from + 16));
+            __m128i c = _mm_loadu_si128((__m128i*)(from + 32));
+            __m128i d = _mm_loadu_si128((__m128i*)(from + 48));
+            _mm_stream_si128((__m128i*)(to +  0), a);
+            _mm_stream_si128((__m128i*)(to + 16), b);
+            _mm_stream_si128((__m128i*)(to + 32), c);
+            _mm_stream_si128((__m128i*)(to + 48), d);
+        }
+        _mm_sfence();
+    } else {
+        for (; size >= 64; size -= 64, to += 64, from += 64) {
+            __m128i a = _mm_loadu_si128((__m128i*)(from +  0));
+            __m128i b = _mm_loadu_si128((__m128i*)(from + 16));
+            __m128i c = _mm_loadu_si128((__m128i*)(from + 32));
+            __m128i d = _mm_loadu_si128((__m128i*)(from + 48));
+            _mm_store_si128((__m128i*)(to +  0), a);
+            _mm_store_si128((__m128i*)(to + 16), b);
+            _mm_store_si128((__m128i*)(to + 32), c);
+            _mm_store_si128((__m128i*)(to + 48), d);
+        }
+    }
+
+    for (; size >= 16; size -= 16, to += 16, from += 16) {
+        _mm_store_si128((__m128i*)to, _mm_loadu_si128((__m128i*)from));
+    }
+    while (size) {
+        *to++ = *from++;
+        size -= 1;
+    }
+}
+
+ALLOCATORS_TARGET_AVX2
+static void HeapArenaCopyAVX2(uint8_t *to, uint8_t *from, int64_t size, bool stream) {
+    while (size && ((uintptr_t)to & 31)) {
+        *to++ = *from++;
+        size -= 1;
+    }
+
+    if (stream) {
+        for (; size >= 128; size -= 128, to += 128, from += 128) {
+            __m256i a = _mm256_loadu_si256((__m256i*)(from +  0));
+            __m256i b = _mm256_loadu_si256((__m256i*)(from + 32));
+            __m256i c = _mm256_loadu_si256((__m256i*)(from + 64));
+            __m256i d = _mm256_loadu_si256((__m256i*)(from + 96));
+            _mm256_stream_si256((__m256i*)(to +  0), a);
+            _mm256_stream_si256((__m256i*)(to + 32), b);
+            _mm256_stream_si256((__m256i*)(to + 64), c);
+            _mm256_stream_si256((__m256i*)(to + 96), d);
+        }
+        _mm_sfence();
+    } else {
+        for (; size >= 128; size -= 128, to += 128, from += 128) {
+            __m256i a = _mm256_loadu_si256((__m256i*)(from +  0));
+            __m256i b = _mm256_loadu_si256((__m256i*)(from + 32));
+            __m256i c = _mm256_loadu_si256((__m256i*)(from + 64));
+            __m256i d = _mm256_loadu_si256((__m256i*)(from + 96));
+            _mm256_store_si256((__m256i*)(to +  0), a);
+            _mm256_store_si256((__m256i*)(to + 32), b);
+            _mm256_store_si256((__m256i*)(to + 64), c);
+            _mm256_store_si256((__m256i*)(to + 96), d);
+        }
+    }
+
+    for (; size >= 32; size -= 32, to += 32, from += 32) {
+        _mm256_store_si256((__m256i*)to, _mm256_loadu_si256((__m256i*)from));
+    }
+    // note: avoids penalty of switching from avx to sse code
+    _mm256_zeroupper();
+    while (size) {
+        *to++ = *from++;
+        size -= 1;
+    }
+}
+
+static void HeapArenaZeroSSE2(uint8_t *to, int64_t size, bool stream) {
+    while (size && ((uintptr_t)to & 15)) {
+        *to++ = 0;
+        size -= 1;
+    }
+
+    __m128i zero = _mm_setzero_si128();
+    if (stream) {
+        for (; size >= 64; size -= 64, to += 64) {
+            _mm_stream_si128((__m128i*)(to +  0), zero);
+            _mm_stream_si128((__m128i*)(to + 16), zero);
+            _mm_stream_si128((__m128i*)(to + 32), zero);
+            _mm_stream_si128((__m128i*)(to + 48), zero);
+        }
+        _mm_sfence();
+    }
+    for (; size >= 16; size -= 16, to += 16) {
+        _mm_store_si128((__m128i*)to, zero);
+    }
+    while (size) {
+        *to++ = 0;
+        size -= 1;
+    }
+}
+
+ALLOCATORS_TARGET_AVX2
+static void HeapArenaZeroAVX2(uint8_t *to, int64_t size, bool stream) {
+    while (size && ((uintptr_t)to & 31)) {
+        *to++ = 0;
+        size -= 1;
+    }
+
+    __m256i zero = _mm256_setzero_si256();
+    if (stream) {
+        for (; size >= 128; size -= 128, to += 128) {
+            _mm256_stream_si256((__m256i*)(to +  0), zero);
+            _mm256_stream_si256((__m256i*)(to + 32), zero);
+            _mm256_stream_si256((__m256i*)(to + 64), zero);
+            _mm256_stream_si256((__m256i*)(to + 96), zero);
+        }
+        _mm_sfence();
+    }
+    for (; size >= 32; size -= 32, to += 32) {
+        _mm256_store_si256((__m256i*)to, zero);
+    }
+    _mm256_zeroupper();
+    while (size) {
+        *to++ = 0;
+        size -= 1;
+    }
+}
+#endif
+
+void HeapArenaCopyMemory(void *dest, void *source, int64_t size) {
+    uint8_t *to   = (uint8_t*)dest;
+    uint8_t *from = (uint8_t*)source;
+
+    // note: realloc never copies into overlapping memory, but the function is public, so it still handles overlap the slow way
+    if (to > from && to < from + size) {
+        for (int64_t i=size-1; i >= 0; --i) {
+            to[i] = from[i]; 
+        }
+        return;
+    }
+
+#ifdef ALLOCATORS_X64
+    bool stream = size >= HEAP_ARENA_STREAMING_THRESHOLD && (from + size <= to || to + size <= from);
+    if (HeapArenaGetKernel() == HEAP_ARENA_KERNEL_AVX2) {
+        HeapArenaCopyAVX2(to, from, size, stream);
+    } else {
+        HeapArenaCopySSE2(to, from, size, stream);
+    }
+#else
+    memmove(to, from, size);
+#endif
+}
+
+void HeapArenaZeroMemory(void *dest, int64_t size) {
+#ifdef ALLOCATORS_X64
+    bool stream = size >= HEAP_ARENA_STREAMING_THRESHOLD;
+    if (HeapArenaGetKernel() == HEAP_ARENA_KERNEL_AVX2) {
+        HeapArenaZeroAVX2((uint8_t*)dest, size, stream);
+    } else {
+        HeapArenaZeroSSE2((uint8_t*)dest, size, stream);
+    }
+#else
+    memset(dest, 0, size);
+#endif
+}
+
+void *HeapArenaAllocateZeroed(HeapArena *arena, int64_t size) {
+    void *memory = HeapArenaAllocate(arena, size);
+    if (memory) {
+        HeapArenaZeroMemory(memory, size);
+    }
+    return memory;
+}
+
+void *HeapArenaRealloc(HeapArena *arena, void *memory, int64_t new_size) {
+    assert((arena->first_block || arena->large_allocations) && "Nothing is allocated yet");
+
+    int64_t old_size = HeapArenaUsableSize(memory);
+    if (HeapArenaIsSlabMemory(memory)) {
+        if (new_size <= HEAP_SLAB_MAX_SIZE && HeapSlabClassIndex(new_size) == HeapSlabFromMemory(memory)->class_index) {
+            return memory;
+        }
+    } else if (HeapArenaIsLargeMemory(memory)) {
+        if (new_size >= HEAP_ARENA_LARGE_ALLOCATION_SIZE) {
+            void *resized = HeapLargeResize(arena, memory, new_size);
+            if (resized) {
+                return resized;
+            }
+        }
+    } else if (new_size < HEAP_ARENA_LARGE_ALLOCATION_SIZE && HeapArenaResizeChunk(arena, GetAllocationNode(memory), HeapArenaChunkSize(new_size))) {
+        HeapArenaStatsFree(arena, old_size);
+        HeapArenaStatsAllocate(arena, HeapArenaUsableSize(memory));
+        return memory;
+    }
+
+    // note: freed chunk is overwritten by the tree links, so we can't free it before the copy
+    void *new_memory = HeapArenaAllocate(arena, new_size);
+    if (!new_memory) {
+        return 0;
+    }
+    int64_t saved_size = old_size;
+    if (old_size > new_size) {
+        saved_size = new_size;
+    }
+    HeapArenaCopyMemory(new_memory, memory, saved_size);
+    HeapArenaFree(arena, memory);
+    return new_memory;
+}
+
+// Batch is cut from one free chunk found with a single lookup: chunks follow each other, the last one takes the rest of the found chunk if it is too small
+// to be separated. Sizes that are served from slabs or get their own mapping are allocated one by one
+void HeapArenaAllocateBatch(HeapArena *arena, int64_t size, int64_t count, void **memory) {
+    if (size <= HEAP_SLAB_MAX_SIZE || size >= HEAP_ARENA_LARGE_ALLOCATION_SIZE) {
+        for (int64_t i = 0; i < count; ++i) {
+            memory[i] = HeapArenaAllocate(arena, size);
+        }
+        return;
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    int64_t chunk_size = HeapArenaChunkSize(size);
+    int64_t run_size   = count * (chunk_size + ALLOCATION_NODE_HEADER_SIZE) - ALLOCATION_NODE_HEADER_SIZE;
+    AllocationNode *node = HeapArenaGetNode(arena, run_size);
+    if (!node) {
+        memset(memory, 0, count * sizeof(void*));
+        return;
+    }
+    HeapArenaSeparateExtraMemory(arena, node, run_size);
+
+    int64_t rest_size = AllocationNodeSize(node);
+    for (int64_t i = 0; i < count - 1; ++i) {
+        node->size = chunk_size | ALLOCATION_NODE_OCCUPIED;
+        rest_size -= chunk_size + ALLOCATION_NODE_HEADER_SIZE;
+
+        AllocationNode *next = GetNextNode(node);
+        next->previous_size = chunk_size;
+        HeapArenaStatsAllocate(arena, chunk_size);
+        memory[i] = SkipAllocationNode(node);
+        node = next;
+    }
+    node->size = rest_size | ALLOCATION_NODE_OCCUPIED;
+    GetNextNode(node)->previous_size = rest_size;
+    HeapArenaStatsAllocate(arena, rest_size);
+    memory[count - 1] = SkipAllocationNode(node);
+}
+
+// heap sort, so sorting needs no memory and has no bad cases
+static inline void HeapArenaSiftDown(uintptr_t *values, int64_t index, int64_t count) {
+    uintptr_t value = values[index];
+    while (2*index + 1 < count) {
+        int64_t child = 2*index + 1;
+        if (child + 1 < count && values[child + 1] > values[child]) {
+            child += 1;
+        }
+        if (values[child] <= value) {
+            break;
+        }
+        values[index] = values[child];
+        index = child;
+    }
+    values[index] = value;
+}
+
+static void HeapArenaSortAddresses(void **memory, int64_t count) {
+    uintptr_t *values = (uintptr_t*)memory;
+    for (int64_t i = count / 2 - 1; i >= 0; --i) {
+        HeapArenaSiftDown(values, i, count);
+    }
+    for (int64_t i = count - 1; i > 0; --i) {
+        uintptr_t value = values[0];
+        values[0] = values[i];
+        values[i] = value;
+        HeapArenaSiftDown(values, 0, i);
+    }
+}
+
+// Memory is sorted by address, so every run of adjacent chunks is turned into one occupied chunk and freed at once:
+// free index is updated once per run instead of once per chunk
+void HeapArenaFreeBatch(HeapArena *arena, void **memory, int64_t count) {
+    HeapArenaSortAddresses(memory, count);
+
+    int64_t i = 0;
+    while (i < count) {
+        void *first = memory[i++];
+        assert((i == 1 || first != memory[i - 2]) && "Memory is freed twice");
+        if (HeapArenaIsSlabMemory(first)) {
+            HeapSlabFree(arena, first);
+            continue;
+        }
+        if (HeapArenaIsLargeMemory(first)) {
+            HeapLargeFree(arena, first);
+            continue;
+        }
+
+        AllocationNode *node = GetAllocationNode(first);
+        AllocationNode *last = node;
+        HeapArenaStatsFree(arena, AllocationNodeSize(node));
+        // note: fence is checked first, memory right after the block may belong to something else
+        while (i < count && AllocationNodeSize(GetNextNode(last)) && memory[i] == SkipAllocationNode(GetNextNode(last))) {
+            last = GetNextNode(last);
+            assert(AllocationNodeOccupied(last) && "Memory is already free");
+            HeapArenaStatsFree(arena, AllocationNodeSize(last));
+            i += 1;
+        }
+
+        if (last != node) {
+            int64_t run_size = (uint8_t*)GetNextNode(last) - (uint8_t*)SkipAllocationNode(node);
+            node->size = run_size | ALLOCATION_NODE_OCCUPIED;
+            GetNextNode(node)->previous_size = run_size;
+            HeapArenaValidateMerge(arena, node, last);
+        }
+        HeapArenaFreeChunk(arena, node);
+    }
+}
+
+#ifdef ALLOCATORS_DEBUG
+#undef HeapArenaAllocate
+#undef HeapArenaAllocateAligned
+#undef HeapArenaAllocateZeroed
+#undef HeapArenaRealloc
+#undef HeapArenaFree
+#undef HeapArenaAllocateBatch
+#undef HeapArenaFreeBatch
+#undef HeapArenaUsableSize
+#if defined(ALLOCATORS_TRACE) || defined(ALLOCATORS_PROFILE)
+#define HeapArenaAllocate        HeapArenaAllocateInternal
+#define HeapArenaAllocateAligned HeapArenaAllocateAlignedInternal
+#define HeapArenaAllocateZeroed  HeapArenaAllocateZeroedInternal
+#define HeapArenaRealloc         HeapArenaReallocInternal
+#define HeapArenaFree            HeapArenaFreeInternal
+#define HeapArenaAllocateBatch   HeapArenaAllocateBatchInternal
+#define HeapArenaFreeBatch       HeapArenaFreeBatchInternal
+#endif
+
+// Checked allocation is placed inside the allocation of the core, user memory follows the 16 byte debug header:
+//     [canary] [size, offset, flags] user memory [trailer canary]
+// canaries are keyed by the address, so a header copied to another place doesn't pass the check. The second word sits where a chunk keeps its size,
+// its low bits are the flags of AllocationNode: OCCUPIED is set while the memory is live, SAMPLED is left to the profiler and the slab and large bits
+// are always zero. Offset is log2 of the distance from the start of the core allocation, it is larger than the header only for aligned allocations
+#define HEAP_DEBUG_CANARY         0xA110CA7EDC0FFEE5ull
+#define HEAP_DEBUG_GUARDED_CANARY 0x6A4D0ED0DEADBEEFull // replaces HEAP_DEBUG_CANARY in front of allocations that have their own mapping
+#define HEAP_DEBUG_HEADER_SIZE    16
+#define HEAP_DEBUG_TRAILER_SIZE   8
+#define HEAP_DEBUG_OFFSET_SHIFT   4
+#define HEAP_DEBUG_SIZE_SHIFT     10
+
+// Freed payloads are filled with HEAP_DEBUG_FREED_BYTE, at most HEAP_DEBUG_POISON_SIZE bytes each, so reads after free are visible and
+// the cost of the fill doesn't grow with the size of the allocation. Define it to 0 to disable poisoning
+#ifndef HEAP_DEBUG_POISON_SIZE
+#define HEAP_DEBUG_POISON_SIZE 64
+#endif
+#ifndef HEAP_DEBUG_FREED_BYTE
+#define HEAP_DEBUG_FREED_BYTE 0xDD
+#endif
+
+// HEAP_DEBUG_REPORT can be defined to a function void (const char *message, void *memory), which logs the error instead of aborting.
+// If it returns, the call that detected the error does nothing with the memory: it is leaked rather than given back to the arena
+#ifndef HEAP_DEBUG_REPORT
+#define HEAP_DEBUG_REPORT HeapDebugReport
+static void HeapDebugReport(const char *message, void *memory) {
+    fprintf(stderr, "allocators: %s (memory %p)\n", message, memory);
+    abort();
+}
+#endif
+
+static inline uint64_t HeapDebugCanary(uint8_t *memory) {
+    return HEAP_DEBUG_CANARY ^ (uint64_t)(uintptr_t)memory;
+}
+
+static inline uint64_t HeapDebugGuardedCanary(uint8_t *memory) {
+    return HEAP_DEBUG_GUARDED_CANARY ^ (uint64_t)(uintptr_t)memory;
+}
+
+static inline int64_t HeapDebugSize(uint64_t word) {
+    return (int64_t)(word >> HEAP_DEBUG_SIZE_SHIFT);
+}
+
+static inline int64_t HeapDebugOffset(uint64_t word) {
+    return (int64_t)1 << ((word >> HEAP_DEBUG_OFFSET_SHIFT) & 63);
+}
+
+// note: the trailer is never closer than a pointer size to the start, because freed memory may carry a link in its first word (see ThreadHeapPushRemoteFree)
+static inline int64_t HeapDebugTrailerOffset(int64_t size) {
+    return size < (int64_t)sizeof(void*) ? (int64_t)sizeof(void*) : size;
+}
+
+// size of the core allocation that holds user memory of the given size placed offset bytes after its start
+static inline int64_t HeapDebugCoreSize(int64_t size, int64_t offset) {
+    return offset + HeapDebugTrailerOffset(size) + HEAP_DEBUG_TRAILER_SIZE;
+}
+
+static inline void *HeapDebugSetup(uint8_t *memory, int64_t size, int64_t offset, uint64_t canary) {
+    uint64_t offset_log2 = HeapLowestBit(offset);
+    ((uint64_t*)memory)[-2] = canary;
+    ((uint64_t*)memory)[-1] = ((uint64_t)size << HEAP_DEBUG_SIZE_SHIFT) | (offset_log2 << HEAP_DEBUG_OFFSET_SHIFT) | ALLOCATION_NODE_OCCUPIED;
+    uint64_t trailer = HeapDebugCanary(memory);
+    memcpy(memory + HeapDebugTrailerOffset(size), &trailer, HEAP_DEBUG_TRAILER_SIZE);
+    return memory;
+}
+
+// returns false if the error is reported, live flag is cleared when the memory is about to be freed,
+// so the second free of the same memory sees it even after the core has reused the words around it
+static bool HeapDebugCheck(uint8_t *memory, bool clear) {
+    if ((uintptr_t)memory & (ALLOCATION_GRANULARITY - 1)) {
+        HEAP_DEBUG_REPORT("Pointer is misaligned, it wasn't returned by the arena", memory);
+        return false;
+    }
+    uint64_t *header = (uint64_t*)memory - 2;
+    if (!(header[1] & ALLOCATION_NODE_OCCUPIED)) {
+        HEAP_DEBUG_REPORT("Memory is freed twice, or it wasn't returned by the arena", memory);
+        return false;
+    }
+    uint64_t canary = HeapDebugCanary(memory);
+    if (header[0] != canary && header[0] != HeapDebugGuardedCanary(memory)) {
+        HEAP_DEBUG_REPORT("Memory in front of the allocation is overwritten, or the pointer wasn't returned by the arena", memory);
+        return false;
+    }
+    uint64_t trailer = 0;
+    memcpy(&trailer, memory + HeapDebugTrailerOffset(HeapDebugSize(header[1])), HEAP_DEBUG_TRAILER_SIZE);
+    if (trailer != canary) {
+        HEAP_DEBUG_REPORT("Memory behind the allocation is overwritten", memory);
+        return false;
+    }
+    if (clear) {
+        header[1] &= ~(uint64_t)ALLOCATION_NODE_OCCUPIED;
+    }
+    return true;
+}
+
+static inline bool HeapDebugIsGuarded(uint8_t *memory) {
+    return ((uint64_t*)memory)[-2] != HeapDebugCanary(memory);
+}
+
+static inline void HeapDebugPoison(uint8_t *memory, int64_t size) {
+    if (size > HEAP_DEBUG_POISON_SIZE) {
+        size = HEAP_DEBUG_POISON_SIZE;
+    }
+    memset(memory, HEAP_DEBUG_FREED_BYTE, size);
+}
+
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+// Guarded allocation ends as close to the guard page as the alignment lets it, the record that keeps its mapping precedes the debug header
+typedef struct HeapDebugGuarded HeapDebugGuarded;
+struct HeapDebugGuarded {
+    HeapDebugGuarded *next;
+    HeapDebugGuarded *previous;
+    uint8_t *mapping;
+    int64_t mapped_size; // including the guard page
+};
+
+static void *HeapDebugAllocateGuarded(HeapArena *arena, int64_t size, int64_t alignment) {
+    if (alignment < ALLOCATION_GRANULARITY) {
+        alignment = ALLOCATION_GRANULARITY;
+    }
+    int64_t committed_size = HeapArenaRoundToPages(sizeof(HeapDebugGuarded) + HeapDebugCoreSize(size, HEAP_DEBUG_HEADER_SIZE) + alignment - 1);
+    int64_t mapped_size = committed_size + HEAP_ARENA_PAGE_SIZE;
+    uint8_t *mapping = PlatformReserveMemory(mapped_size);
+    if (!mapping) {
+        return 0;
+    }
+    uint8_t *memory = (uint8_t*)(((uintptr_t)mapping + committed_size - HeapDebugTrailerOffset(size) - HEAP_DEBUG_TRAILER_SIZE) & ~(uintptr_t)(alignment - 1));
+    bool committed = PlatformCommitMemory(mapping, committed_size);
+#ifdef ALLOCATORS_THREAD_SAFE
+    committed = committed && HeapPageMapSet(memory, 1, arena);
+#endif
+    if (!committed) {
+        PlatformFreeMemory(mapping, mapped_size);
+        return 0;
+    }
+
+    HeapDebugGuarded *guarded = (HeapDebugGuarded*)(memory - HEAP_DEBUG_HEADER_SIZE) - 1;
+    guarded->mapping = mapping;
+    guarded->mapped_size = mapped_size;
+    guarded->previous = 0;
+    guarded->next = arena->guarded_allocations;
+    if (guarded->next) {
+        guarded->next->previous = guarded;
+    }
+    arena->guarded_allocations = guarded;
+
+    arena->allocated_size += mapped_size;
+    arena->large_count += 1;
+    HeapArenaStatsAllocate(arena, size);
+    return HeapDebugSetup(memory, size, HEAP_DEBUG_HEADER_SIZE, HeapDebugGuardedCanary(memory));
+}
+
+static void HeapDebugFreeGuarded(HeapArena *arena, uint8_t *memory) {
+    HeapDebugGuarded *guarded = (HeapDebugGuarded*)(memory - HEAP_DEBUG_HEADER_SIZE) - 1;
+    if (guarded->previous) {
+        guarded->previous->next = guarded->next;
+    } else {
+        assert(arena->guarded_allocations == guarded);
+        arena->guarded_allocations = guarded->next;
+    }
+    if (guarded->next) {
+        guarded->next->previous = guarded->previous;
+    }
+    arena->allocated_size -= guarded->mapped_size;
+    arena->large_count -= 1;
+    HeapArenaStatsFree(arena, HeapDebugSize(((uint64_t*)memory)[-1]));
+#ifdef ALLOCATORS_THREAD_SAFE
+    HeapPageMapSet(memory, 1, 0);
+#endif
+    // note: the whole mapping is released, so use after free faults as well, until the platform reuses the addresses
+    PlatformFreeMemory(guarded->mapping, guarded->mapped_size);
+}
+#endif
+
+#if defined(ALLOCATORS_THREAD_SAFE) && !defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+// Large allocation maps only the page of its payload (see HeapLargeLink), but user memory of an aligned one starts alignment bytes later,
+// so its page is mapped as well while the memory is live. Arena 0 clears it. Returns false if the page map has no memory for it
+static bool HeapDebugMapUserPage(HeapArena *arena, uint8_t *core, uint8_t *memory) {
+    if (((uintptr_t)core >> HEAP_PAGE_MAP_SHIFT) == ((uintptr_t)memory >> HEAP_PAGE_MAP_SHIFT) || !HeapArenaIsLargeMemory(core)) {
+        return true;
+    }
+    return HeapPageMapSet(memory, 1, arena);
+}
+#endif
+
+void *HeapArenaAllocate(HeapArena *arena, int64_t size) {
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    return HeapDebugAllocateGuarded(arena, size, ALLOCATION_GRANULARITY);
+#else
+    uint8_t *memory = HeapArenaAllocateCore(arena, HeapDebugCoreSize(size, HEAP_DEBUG_HEADER_SIZE));
+    if (!memory) {
+        return 0;
+    }
+    return HeapDebugSetup(memory + HEAP_DEBUG_HEADER_SIZE, size, HEAP_DEBUG_HEADER_SIZE, HeapDebugCanary(memory + HEAP_DEBUG_HEADER_SIZE));
+#endif
+}
+
+// note: payload of the core allocation is aligned, so the user memory starts alignment bytes later, which leaves room for the header
+void *HeapArenaAllocateAligned(HeapArena *arena, int64_t size, int64_t alignment) {
+    assert(alignment > 0 && !(alignment & (alignment - 1)) && "Alignment should be a power of two");
+    if (alignment <= ALLOCATION_GRANULARITY) {
+        return HeapArenaAllocate(arena, size);
+    }
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    return HeapDebugAllocateGuarded(arena, size, alignment);
+#else
+    uint8_t *memory = HeapArenaAllocateAlignedCore(arena, HeapDebugCoreSize(size, alignment), alignment);
+    if (!memory) {
+        return 0;
+    }
+#ifdef ALLOCATORS_THREAD_SAFE
+    if (!HeapDebugMapUserPage(arena, memory, memory + alignment)) {
+        HeapArenaFreeCore(arena, memory);
+        return 0;
+    }
+#endif
+    return HeapDebugSetup(memory + alignment, size, alignment, HeapDebugCanary(memory + alignment));
+#endif
+}
+
+void *HeapArenaAllocateZeroed(HeapArena *arena, int64_t size) {
+    void *memory = HeapArenaAllocate(arena, size);
+    if (memory) {
+        HeapArenaZeroMemory(memory, size);
+    }
+    return memory;
+}
+
+void HeapArenaFree(HeapArena *arena, void *memory) {
+    if (!HeapDebugCheck(memory, true)) {
+        return;
+    }
+    uint64_t word = ((uint64_t*)memory)[-1];
+    HeapDebugPoison(memory, HeapDebugSize(word));
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    if (HeapDebugIsGuarded(memory)) {
+        HeapDebugFreeGuarded(arena, memory);
+        return;
+    }
+#endif
+    uint8_t *core = (uint8_t*)memory - HeapDebugOffset(word);
+#if defined(ALLOCATORS_THREAD_SAFE) && !defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+    HeapDebugMapUserPage(0, core, memory);
+#endif
+    HeapArenaFreeCore(arena, core);
+}
+
+void *HeapArenaRealloc(HeapArena *arena, void *memory, int64_t new_size) {
+    if (!HeapDebugCheck(memory, false)) {
+        return 0;
+    }
+    uint64_t word = ((uint64_t*)memory)[-1];
+    if (HeapDebugIsGuarded(memory)) {
+        int64_t saved_size = HeapDebugSize(word);
+        if (saved_size > new_size) {
+            saved_size = new_size;
+        }
+        void *new_memory = HeapArenaAllocate(arena, new_size);
+        if (!new_memory) {
+            return 0;
+        }
+        HeapArenaCopyMemory(new_memory, memory, saved_size);
+        HeapArenaFree(arena, memory);
+        return new_memory;
+    }
+
+    // note: the core keeps the contents, header included, so the user memory stays at the same offset
+    int64_t offset = HeapDebugOffset(word);
+    uint8_t *old_core = (uint8_t*)memory - offset;
+#if defined(ALLOCATORS_THREAD_SAFE) && !defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+    // note: the page of the user memory is cleared first, the core may give the mapping back or move it
+    HeapDebugMapUserPage(0, old_core, memory);
+#endif
+    uint8_t *core = HeapArenaReallocCore(arena, old_core, HeapDebugCoreSize(new_size, offset));
+#if defined(ALLOCATORS_THREAD_SAFE) && !defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+    // note: leaf of the page existed before, so it can be missing only if the platform has moved the mapping, see HeapLargeLink
+    bool mapped = core ? HeapDebugMapUserPage(arena, core, core + offset) : HeapDebugMapUserPage(arena, old_core, memory);
+    assert(mapped && "Page map has no memory for the moved allocation");
+    (void)mapped;
+#endif
+    if (!core) {
+        return 0;
+    }
+    return HeapDebugSetup(core + offset, new_size, offset, HeapDebugCanary(core + offset));
+}
+
+void HeapArenaAllocateBatch(HeapArena *arena, int64_t size, int64_t count, void **memory) {
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    for (int64_t i = 0; i < count; ++i) {
+        memory[i] = HeapArenaAllocate(arena, size);
+    }
+#else
+    HeapArenaAllocateBatchCore(arena, HeapDebugCoreSize(size, HEAP_DEBUG_HEADER_SIZE), count, memory);
+    for (int64_t i = 0; i < count; ++i) {
+        if (!memory[i]) {
+            continue;
+        }
+        uint8_t *user = (uint8_t*)memory[i] + HEAP_DEBUG_HEADER_SIZE;
+        memory[i] = HeapDebugSetup(user, size, HEAP_DEBUG_HEADER_SIZE, HeapDebugCanary(user));
+    }
+#endif
+}
+
+// note: memory that fails the check or has its own mapping is taken out of the batch, the rest is handed to the core as its own pointers
+void HeapArenaFreeBatch(HeapArena *arena, void **memory, int64_t count) {
+    int64_t core_count = 0;
+    for (int64_t i = 0; i < count; ++i) {
+        uint8_t *user = memory[i];
+        if (!HeapDebugCheck(user, true)) {
+            continue;
+        }
+        uint64_t word = ((uint64_t*)user)[-1];
+        HeapDebugPoison(user, HeapDebugSize(word));
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+        if (HeapDebugIsGuarded(user)) {
+            HeapDebugFreeGuarded(arena, user);
+            continue;
+        }
+#endif
+        memory[core_count++] = user - HeapDebugOffset(word);
+#if defined(ALLOCATORS_THREAD_SAFE) && !defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+        HeapDebugMapUserPage(0, memory[core_count - 1], user);
+#endif
+    }
+    HeapArenaFreeBatchCore(arena, memory, core_count);
+}
+
+int64_t HeapArenaUsableSize(void *memory) {
+    return HeapDebugSize(((uint64_t*)memory)[-1]);
+}
+#endif
+
+#if defined(ALLOCATORS_TRACE) || defined(ALLOCATORS_PROFILE)
+#undef HeapArenaAllocate
+#undef HeapArenaAllocateAligned
+#undef HeapArenaAllocateZeroed
+#undef HeapArenaRealloc
+#undef HeapArenaFree
+#undef HeapArenaAllocateBatch
+#undef HeapArenaFreeBatch
+
+// Address table maps addresses of live objects to whatever tracer or profiler keeps about them, it is open addressing hash table (linear probing).
+// All its memory comes straight from the platform, so it doesn't disturb the arenas being observed
+typedef struct HeapAddressEntry HeapAddressEntry;
+struct HeapAddressEntry {
+    void *memory; // null if the entry is empty
+    HeapArena *arena;
+    int64_t size;
+    uint32_t value;
+};
+
+typedef struct HeapAddressTable HeapAddressTable;
+struct HeapAddressTable {
+    HeapAddressEntry *entries;
+    int64_t capacity; // power of two
+    int64_t count;
+};
+
+static inline int64_t HeapAddressHash(HeapAddressTable *table, void *memory) {
+    return (int64_t)(((uint64_t)(uintptr_t)memory * 0x9E3779B97F4A7C15ull) >> 32) & (table->capacity - 1);
+}
+
+static void HeapAddressInsert(HeapAddressTable *table, HeapAddressEntry entry);
+
+static void HeapAddressRebuild(HeapAddressTable *table, int64_t capacity, HeapArena *dropped_arena) {
+    HeapAddressEntry *old_entries = table->entries;
+    int64_t old_capacity = table->capacity;
+
+    table->capacity = capacity;
+    table->entries = PlatformGetMemory(capacity * sizeof(HeapAddressEntry));
+    memset(table->entries, 0, capacity * sizeof(HeapAddressEntry));
+    table->count = 0;
+    for (int64_t i = 0; i < old_capacity; ++i) {
+        if (old_entries[i].memory && old_entries[i].arena != dropped_arena) {
+            HeapAddressInsert(table, old_entries[i]);
+        }
+    }
+    if (old_entries) {
+        PlatformFreeMemory(old_entries, old_capacity * sizeof(HeapAddressEntry));
+    }
+}
+
+// note: address may be still in the table, if it was freed without notice (e.g. by HeapArenaRelease), then the entry is replaced
+static void HeapAddressInsert(HeapAddressTable *table, HeapAddressEntry entry) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        HeapAddressRebuild(table, table->capacity ? table->capacity * 2 : 4096, 0);
+    }
+    int64_t mask = table->capacity - 1;
+    int64_t index = HeapAddressHash(table, entry.memory);
+    while (table->entries[index].memory && table->entries[index].memory != entry.memory) {
+        index = (index + 1) & mask;
+    }
+    if (!table->entries[index].memory) {
+        table->count += 1;
+    }
+    table->entries[index] = entry;
+}
+
+// returns false if address isn't in the table, e.g. it was allocated before the trace started
+static bool HeapAddressRemove(HeapAddressTable *table, void *memory, HeapAddressEntry *entry) {
+    if (!table->capacity) {
+        return false;
+    }
+    int64_t mask = table->capacity - 1;
+    int64_t index = HeapAddressHash(table, memory);
+    while (table->entries[index].memory != memory) {
+        if (!table->entries[index].memory) {
+            return false;
+        }
+        index = (index + 1) & mask;
+    }
+    *entry = table->entries[index];
+    table->count -= 1;
+
+    // note: entries that follow are shifted back into the hole, so lookups never stop at it too early
+    int64_t hole = index;
+    for (int64_t next = (hole + 1) & mask; table->entries[next].memory; next = (next + 1) & mask) {
+        int64_t home = HeapAddressHash(table, table->entries[next].memory);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->entries[hole] = table->entries[next];
+            hole = next;
+        }
+    }
+    table->entries[hole].memory = 0;
+    return true;
+}
+
+static void HeapAddressRelease(HeapAddressTable *table) {
+    if (table->entries) {
+        PlatformFreeMemory(table->entries, table->capacity * sizeof(HeapAddressEntry));
+    }
+    memset(table, 0, sizeof(HeapAddressTable));
+}
+#endif
+
+#ifdef ALLOCATORS_TRACE
+#ifndef HEAP_TRACE_BUFFER_COUNT
+#define HEAP_TRACE_BUFFER_COUNT 4096
+#endif
+
+typedef struct HeapTrace HeapTrace;
+struct HeapTrace {
+    void *volatile file; // FILE*, null if trace isn't running
+    volatile int32_t lock;
+    int64_t start_time;
+
+    HeapAddressTable objects; // value is the object id
+    uint32_t *free_objects; // ids that can be reused
+    int64_t free_object_capacity;
+    int64_t free_object_count;
+    uint32_t next_object;
+    uint16_t thread_count; // never reset, threads keep their ids across traces
+
+    int64_t buffered;
+    HeapTraceRecord buffer[HEAP_TRACE_BUFFER_COUNT];
+};
+
+static HeapTrace heap_trace;
+static ALLOCATORS_THREAD_LOCAL uint16_t heap_trace_thread; // thread id + 1, zero until the first traced call
+
+static inline int64_t HeapTraceNow(void) {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static inline void HeapTraceLock(void) {
+    while (!AtomicCompareExchange32(&heap_trace.lock, 0, 1)) {
+    }
+}
+
+static inline void HeapTraceUnlock(void) {
+    AtomicStore32(&heap_trace.lock, 0);
+}
+
+static uint32_t HeapTraceNewObject(void) {
+    if (heap_trace.free_object_count) {
+        return heap_trace.free_objects[--heap_trace.free_object_count];
+    }
+    return heap_trace.next_object++;
+}
+
+static void HeapTraceFreeObject(uint32_t object) {
+    if (heap_trace.free_object_count == heap_trace.free_object_capacity) {
+        uint32_t *old_objects = heap_trace.free_objects;
+        int64_t old_capacity = heap_trace.free_object_capacity;
+
+        heap_trace.free_object_capacity = old_capacity ? old_capacity * 2 : 4096;
+        heap_trace.free_objects = PlatformGetMemory(heap_trace.free_object_capacity * sizeof(uint32_t));
+        if (old_objects) {
+            memcpy(heap_trace.free_objects, old_objects, old_capacity * sizeof(uint32_t));
+            PlatformFreeMemory(old_objects, old_capacity * sizeof(uint32_t));
+        }
+    }
+    heap_trace.free_objects[heap_trace.free_object_count++] = object;
+}
+
+static void HeapTraceFlush(void) {
+    fwrite(heap_trace.buffer, sizeof(HeapTraceRecord), heap_trace.buffered, heap_trace.file);
+    heap_trace.buffered = 0;
+}
+
+// note: free is traced before the memory is actually freed and allocation after it is done, so the address is in the table only while it is occupied
+static void HeapTraceEvent(HeapTraceOp op, void *old_memory, void *new_memory, int64_t size, int64_t alignment) {
+    if (!AtomicLoadPointer(&heap_trace.file)) {
+        return;
+    }
+    HeapTraceLock();
+    if (!heap_trace.file) {
+        HeapTraceUnlock();
+        return;
+    }
+
+    HeapAddressEntry entry = {0};
+    if (op == HEAP_TRACE_FREE) {
+        if (!HeapAddressRemove(&heap_trace.objects, old_memory, &entry)) {
+            HeapTraceUnlock();
+            return;
+        }
+        HeapTraceFreeObject(entry.value);
+    } else if (op == HEAP_TRACE_REALLOC && HeapAddressRemove(&heap_trace.objects, old_memory, &entry)) {
+        entry.memory = new_memory;
+        HeapAddressInsert(&heap_trace.objects, entry);
+    } else {
+        // note: realloc of memory allocated before the trace started is recorded as a new allocation
+        if (op == HEAP_TRACE_REALLOC) {
+            op = HEAP_TRACE_ALLOCATE;
+        }
+        entry.memory = new_memory;
+        entry.value = HeapTraceNewObject();
+        HeapAddressInsert(&heap_trace.objects, entry);
+    }
+
+    if (!heap_trace_thread) {
+        heap_trace_thread = ++heap_trace.thread_count;
+    }
+    uint8_t alignment_log2 = 0;
+    while (((int64_t)1 << alignment_log2) < alignment) {
+        alignment_log2 += 1;
+    }
+
+    HeapTraceRecord *record = &heap_trace.buffer[heap_trace.buffered++];
+    record->time = HeapTraceNow() - heap_trace.start_time;
+    record->size = size;
+    record->object = entry.value;
+    record->thread = heap_trace_thread - 1;
+    record->op = op;
+    record->alignment_log2 = alignment_log2;
+    if (heap_trace.buffered == HEAP_TRACE_BUFFER_COUNT) {
+        HeapTraceFlush();
+    }
+    HeapTraceUnlock();
+}
+
+bool HeapTraceStart(const char *path) {
+    if (AtomicLoadPointer(&heap_trace.file)) {
+        return false;
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    // note: records are buffered by the tracer, file buffer would be allocated with malloc, which may be traced itself
+    setvbuf(file, 0, _IONBF, 0);
+    uint32_t header[2] = {HEAP_TRACE_MAGIC, HEAP_TRACE_VERSION};
+    fwrite(header, sizeof(header), 1, file);
+
+    HeapTraceLock();
+    heap_trace.start_time = HeapTraceNow();
+    AtomicExchangePointer(&heap_trace.file, file);
+    HeapTraceUnlock();
+    return true;
+}
+
+void HeapTraceStop(void) {
+    HeapTraceLock();
+    FILE *file = heap_trace.file;
+    if (!file) {
+        HeapTraceUnlock();
+        return;
+    }
+    HeapTraceFlush();
+    AtomicExchangePointer(&heap_trace.file, 0);
+    HeapAddressRelease(&heap_trace.objects);
+    if (heap_trace.free_objects) {
+        PlatformFreeMemory(heap_trace.free_objects, heap_trace.free_object_capacity * sizeof(uint32_t));
+    }
+    heap_trace.free_objects = 0;
+    heap_trace.free_object_capacity = 0;
+    heap_trace.free_object_count = 0;
+    heap_trace.next_object = 0;
+    HeapTraceUnlock();
+
+    fclose(file);
+}
+#endif
+
+#ifdef ALLOCATORS_PROFILE
+#ifndef HEAP_PROFILE_SAMPLE_RATE
+#define HEAP_PROFILE_SAMPLE_RATE 512*1024
+#endif
+#ifndef HEAP_PROFILE_MAX_DEPTH
+#define HEAP_PROFILE_MAX_DEPTH 32
+#endif
+
+// Sampled allocations are counted per unique call stack, stacks are never removed while the profiler runs, so cumulative numbers survive frees
+typedef struct HeapProfileStack HeapProfileStack;
+struct HeapProfileStack {
+    uint64_t hash;
+    int64_t depth;
+    int64_t inuse_count;
+    int64_t inuse_size;
+    int64_t alloc_count;
+    int64_t alloc_size;
+    void *frames[HEAP_PROFILE_MAX_DEPTH];
+};
+
+typedef struct HeapProfile HeapProfile;
+struct HeapProfile {
+    volatile int32_t active;
+    volatile int32_t lock;
+    int64_t sample_rate;
+
+    HeapAddressTable samples; // sampled live allocations, value is the index of their stack
+    HeapProfileStack *stacks;
+    int64_t stack_count;
+    int64_t stack_capacity;
+    uint32_t *stack_table; // open addressing table of stack indices + 1, keyed by the stack hash
+    int64_t stack_table_capacity;
+};
+
+static HeapProfile heap_profile;
+static ALLOCATORS_THREAD_LOCAL int64_t heap_profile_countdown; // bytes left till the next sample
+static ALLOCATORS_THREAD_LOCAL uint64_t heap_profile_random; // zero until the first allocation of the thread
+static ALLOCATORS_THREAD_LOCAL bool heap_profile_busy; // stack capture and dumping may allocate themselves, such allocations are never sampled
+
+static inline void HeapProfileLock(void) {
+    while (!AtomicCompareExchange32(&heap_profile.lock, 0, 1)) {
+    }
+}
+
+static inline void HeapProfileUnlock(void) {
+    AtomicStore32(&heap_profile.lock, 0);
+}
+
+// natural logarithm for x in (0, 1], good enough for picking sample intervals and it doesn't need libm
+static inline double HeapProfileLog(double x) {
+    uint64_t bits = 0;
+    memcpy(&bits, &x, sizeof(bits));
+    int64_t exponent = (int64_t)((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull;
+    double mantissa = 0;
+    memcpy(&mantissa, &bits, sizeof(mantissa));
+
+    double t  = (mantissa - 1) / (mantissa + 1);
+    double t2 = t * t;
+    return exponent * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0/3 + t2 * (1.0/5 + t2 * (1.0/7 + t2 / 9))));
+}
+
+// intervals between samples are exponentially distributed, so every allocated byte has the same chance to be sampled
+static inline int64_t HeapProfileNextInterval(void) {
+    uint64_t x = heap_profile_random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    heap_profile_random = x;
+
+    double uniform = (double)((x >> 11) + 1) / (double)(1ull << 53);
+    return (int64_t)(-HeapProfileLog(uniform) * heap_profile.sample_rate) + 1;
+}
+
+static uint32_t HeapProfileFindStack(void **frames, int64_t depth) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int64_t i = 0; i < depth; ++i) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001B3ull;
+    }
+
+    if ((heap_profile.stack_count + 1) * 2 > heap_profile.stack_table_capacity) {
+        if (heap_profile.stack_table) {
+            PlatformFreeMemory(heap_profile.stack_table, heap_profile.stack_table_capacity * sizeof(uint32_t));
+        }
+        heap_profile.stack_table_capacity = heap_profile.stack_table_capacity ? heap_profile.stack_table_capacity * 2 : 1024;
+        heap_profile.stack_table = PlatformGetMemory(heap_profile.stack_table_capacity * sizeof(uint32_t));
+        memset(heap_profile.stack_table, 0, heap_profile.stack_table_capacity * sizeof(uint32_t));
+        for (int64_t i = 0; i < heap_profile.stack_count; ++i) {
+            int64_t index = heap_profile.stacks[i].hash & (heap_profile.stack_table_capacity - 1);
+            while (heap_profile.stack_table[index]) {
+                index = (index + 1) & (heap_profile.stack_table_capacity - 1);
+            }
+            heap_profile.stack_table[index] = (uint32_t)i + 1;
+        }
+    }
+
+    int64_t index = hash & (heap_profile.stack_table_capacity - 1);
+    while (heap_profile.stack_table[index]) {
+        HeapProfileStack *stack = &heap_profile.stacks[heap_profile.stack_table[index] - 1];
+        if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return heap_profile.stack_table[index] - 1;
+        }
+        index = (index + 1) & (heap_profile.stack_table_capacity - 1);
+    }
+
+    if (heap_profile.stack_count == heap_profile.stack_capacity) {
+        HeapProfileStack *old_stacks = heap_profile.stacks;
+        int64_t old_capacity = heap_profile.stack_capacity;
+
+        heap_profile.stack_capacity = old_capacity ? old_capacity * 2 : 256;
+        heap_profile.stacks = PlatformGetMemory(heap_profile.stack_capacity * sizeof(HeapProfileStack));
+        if (old_stacks) {
+            memcpy(heap_profile.stacks, old_stacks, old_capacity * sizeof(HeapProfileStack));
+            PlatformFreeMemory(old_stacks, old_capacity * sizeof(HeapProfileStack));
+        }
+    }
+    HeapProfileStack *stack = &heap_profile.stacks[heap_profile.stack_count];
+    memset(stack, 0, sizeof(HeapProfileStack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    heap_profile.stack_table[index] = (uint32_t)heap_profile.stack_count + 1;
+    return (uint32_t)heap_profile.stack_count++;
+}
+
+static void HeapProfileSample(HeapArena *arena, void *memory, int64_t size) {
+    if (heap_profile_busy) {
+        return;
+    }
+    heap_profile_busy = true;
+
+    // note: the first allocation of the thread only starts its countdown, otherwise it would be always sampled
+    if (!heap_profile_random) {
+        heap_profile_random = ((uint64_t)(uintptr_t)&heap_profile_random * 0x9E3779B97F4A7C15ull) | 1;
+        heap_profile_countdown += HeapProfileNextInterval();
+        if (heap_profile_countdown > 0) {
+            heap_profile_busy = false;
+            return;
+        }
+    }
+
+    void *frames[HEAP_PROFILE_MAX_DEPTH];
+    int64_t depth = PlatformCaptureStack(frames, HEAP_PROFILE_MAX_DEPTH);
+
+    HeapProfileLock();
+    if (heap_profile.active) {
+        uint32_t index = HeapProfileFindStack(frames, depth);
+        HeapProfileStack *stack = &heap_profile.stacks[index];
+        stack->inuse_count += 1;
+        stack->inuse_size  += size;
+        stack->alloc_count += 1;
+        stack->alloc_size  += size;
+
+        HeapAddressEntry entry = {memory, arena, size, index};
+        HeapAddressInsert(&heap_profile.samples, entry);
+        ((uint64_t*)memory)[-1] |= ALLOCATION_NODE_SAMPLED;
+    }
+    HeapProfileUnlock();
+
+    heap_profile_countdown = HeapProfileNextInterval();
+    heap_profile_busy = false;
+}
+
+static inline void HeapProfileAllocate(HeapArena *arena, void *memory, int64_t size) {
+    if (!memory || !AtomicLoad32(&heap_profile.active)) {
+        return;
+    }
+    heap_profile_countdown -= size;
+    if (heap_profile_countdown <= 0) {
+        HeapProfileSample(arena, memory, size);
+    }
+}
+
+// note: sampled flag is cleared before the memory goes back to the arena, which expects to see only its own flags
+static inline void HeapProfileFree(void *memory) {
+    if (!memory) {
+        return;
+    }
+    uint64_t *tag = (uint64_t*)memory - 1;
+    if (!(*tag & ALLOCATION_NODE_SAMPLED)) {
+        return;
+    }
+    *tag &= ~(uint64_t)ALLOCATION_NODE_SAMPLED;
+
+    HeapProfileLock();
+    HeapAddressEntry entry;
+    if (HeapAddressRemove(&heap_profile.samples, memory, &entry)) {
+        HeapProfileStack *stack = &heap_profile.stacks[entry.value];
+        stack->inuse_count -= 1;
+        stack->inuse_size  -= entry.size;
+    }
+    HeapProfileUnlock();
+}
+
+// memory released with the whole arena is never freed one by one, so its samples are dropped here
+static void HeapProfileReleaseArena(HeapArena *arena) {
+    HeapProfileLock();
+    for (int64_t i = 0; i < heap_profile.samples.capacity; ++i) {
+        HeapAddressEntry *entry = &heap_profile.samples.entries[i];
+        if (entry->memory && entry->arena == arena) {
+            heap_profile.stacks[entry->value].inuse_count -= 1;
+            heap_profile.stacks[entry->value].inuse_size  -= entry->size;
+        }
+    }
+    if (heap_profile.samples.capacity) {
+        HeapAddressRebuild(&heap_profile.samples, heap_profile.samples.capacity, arena);
+    }
+    HeapProfileUnlock();
+}
+
+void HeapProfileStart(int64_t sample_rate) {
+    // note: the first capture may load the unwinder, which allocates, so it is done before the profiler is active
+    void *frames[HEAP_PROFILE_MAX_DEPTH];
+    heap_profile_busy = true;
+    PlatformCaptureStack(frames, HEAP_PROFILE_MAX_DEPTH);
+    heap_profile_busy = false;
+
+    HeapProfileLock();
+    heap_profile.sample_rate = sample_rate > 0 ? sample_rate : HEAP_PROFILE_SAMPLE_RATE;
+    AtomicStore32(&heap_profile.active, 1);
+    HeapProfileUnlock();
+}
+
+void HeapProfileStop(void) {
+    HeapProfileLock();
+    AtomicStore32(&heap_profile.active, 0);
+    HeapAddressRelease(&heap_profile.samples);
+    if (heap_profile.stacks) {
+        PlatformFreeMemory(heap_profile.stacks, heap_profile.stack_capacity * sizeof(HeapProfileStack));
+    }
+    if (heap_profile.stack_table) {
+        PlatformFreeMemory(heap_profile.stack_table, heap_profile.stack_table_capacity * sizeof(uint32_t));
+    }
+    heap_profile.stacks = 0;
+    heap_profile.stack_count = 0;
+    heap_profile.stack_capacity = 0;
+    heap_profile.stack_table = 0;
+    heap_profile.stack_table_capacity = 0;
+    HeapProfileUnlock();
+}
+
+// Profile is written from a copy of the stacks, because the file functions may allocate and free, and they may hit sampled memory
+bool HeapProfileDump(const char *path) {
+    HeapProfileLock();
+    int64_t stack_count = heap_profile.stack_count;
+    int64_t sample_rate = heap_profile.sample_rate;
+    int64_t copy_size = (stack_count ? stack_count : 1) * sizeof(HeapProfileStack);
+    HeapProfileStack *stacks = PlatformGetMemory(copy_size);
+    memcpy(stacks, heap_profile.stacks, stack_count * sizeof(HeapProfileStack));
+    HeapProfileUnlock();
+
+    heap_profile_busy = true;
+    FILE *file = fopen(path, "w");
+    if (file) {
+        HeapProfileStack total = {0};
+        for (int64_t i = 0; i < stack_count; ++i) {
+            total.inuse_count += stacks[i].inuse_count;
+            total.inuse_size  += stacks[i].inuse_size;
+            total.alloc_count += stacks[i].alloc_count;
+            total.alloc_size  += stacks[i].alloc_size;
+        }
+        fprintf(file, "heap profile: %lld: %lld [%lld: %lld] @ heap_v2/%lld\n",
+                (long long)total.inuse_count, (long long)total.inuse_size, (long long)total.alloc_count, (long long)total.alloc_size, (long long)sample_rate);
+        for (int64_t i = 0; i < stack_count; ++i) {
+            HeapProfileStack *stack = &stacks[i];
+            fprintf(file, "%lld: %lld [%lld: %lld] @",
+                    (long long)stack->inuse_count, (long long)stack->inuse_size, (long long)stack->alloc_count, (long long)stack->alloc_size);
+            for (int64_t j = 0; j < stack->depth; ++j) {
+                fprintf(file, " %p", stack->frames[j]);
+            }
+            fprintf(file, "\n");
+        }
+
+#ifdef __linux__
+        // note: pprof needs the mappings to find symbols of the addresses
+        FILE *maps = fopen("/proc/self/maps", "r");
+        if (maps) {
+            fprintf(file, "\nMAPPED_LIBRARIES:\n");
+            char buffer[4096];
+            size_t read_size = 0;
+            while ((read_size = fread(buffer, 1, sizeof(buffer), maps)) > 0) {
+                fwrite(buffer, 1, read_size, file);
+            }
+            fclose(maps);
+        }
+#endif
+        fclose(file);
+    }
+    heap_profile_busy = false;
+
+    PlatformFreeMemory(stacks, copy_size);
+    return file != 0;
+}
+#endif
+
+#if defined(ALLOCATORS_TRACE) || defined(ALLOCATORS_PROFILE)
+static inline void HeapArenaOnAllocate(HeapArena *arena, void *memory, int64_t size, int64_t alignment, HeapTraceOp op) {
+    if (!memory) {
+        return;
+    }
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileAllocate(arena, memory, size);
+#else
+    (void)arena;
+#endif
+#ifdef ALLOCATORS_TRACE
+    HeapTraceEvent(op, 0, memory, size, alignment);
+#else
+    (void)alignment;
+    (void)op;
+#endif
+}
+
+void *HeapArenaAllocate(HeapArena *arena, int64_t size) {
+    void *memory = HeapArenaAllocateInternal(arena, size);
+    HeapArenaOnAllocate(arena, memory, size, 0, HEAP_TRACE_ALLOCATE);
+    return memory;
+}
+
+void *HeapArenaAllocateAligned(HeapArena *arena, int64_t size, int64_t alignment) {
+    void *memory = HeapArenaAllocateAlignedInternal(arena, size, alignment);
+    HeapArenaOnAllocate(arena, memory, size, alignment, HEAP_TRACE_ALLOCATE);
+    return memory;
+}
+
+void *HeapArenaAllocateZeroed(HeapArena *arena, int64_t size) {
+    void *memory = HeapArenaAllocateZeroedInternal(arena, size);
+    HeapArenaOnAllocate(arena, memory, size, 0, HEAP_TRACE_ALLOCATE_ZEROED);
+    return memory;
+}
+
+void *HeapArenaRealloc(HeapArena *arena, void *memory, int64_t new_size) {
+#ifdef ALLOCATORS_PROFILE
+    // note: realloc may rewrite the header, so the old sample is dropped and the result may be sampled again
+    HeapProfileFree(memory);
+#endif
+    void *new_memory = HeapArenaReallocInternal(arena, memory, new_size);
+    if (!new_memory) {
+        // note: memory is kept by the caller, but it isn't sampled anymore
+        return 0;
+    }
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileAllocate(arena, new_memory, new_size);
+#endif
+#ifdef ALLOCATORS_TRACE
+    HeapTraceEvent(HEAP_TRACE_REALLOC, memory, new_memory, new_size, 0);
+#endif
+    return new_memory;
+}
+
+void HeapArenaFree(HeapArena *arena, void *memory) {
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileFree(memory);
+#endif
+#ifdef ALLOCATORS_TRACE
+    HeapTraceEvent(HEAP_TRACE_FREE, memory, 0, 0, 0);
+#endif
+    HeapArenaFreeInternal(arena, memory);
+}
+
+void HeapArenaAllocateBatch(HeapArena *arena, int64_t size, int64_t count, void **memory) {
+    HeapArenaAllocateBatchInternal(arena, size, count, memory);
+    for (int64_t i = 0; i < count; ++i) {
+        HeapArenaOnAllocate(arena, memory[i], size, 0, HEAP_TRACE_ALLOCATE);
+    }
+}
+
+void HeapArenaFreeBatch(HeapArena *arena, void **memory, int64_t count) {
+    for (int64_t i = 0; i < count; ++i) {
+#ifdef ALLOCATORS_PROFILE
+        HeapProfileFree(memory[i]);
+#endif
+#ifdef ALLOCATORS_TRACE
+        HeapTraceEvent(HEAP_TRACE_FREE, memory[i], 0, 0, 0);
+#endif
+    }
+    HeapArenaFreeBatchInternal(arena, memory, count);
+}
+#endif
+
+HeapArenaStats HeapArenaGetStats(HeapArena *arena) {
+    HeapArenaStats stats = {0};
+    stats.allocated_size   = arena->allocated_size;
+    stats.free_size        = arena->free_size;
+    stats.live_size        = arena->live_size;
+    stats.overhead_size    = arena->allocated_size - arena->free_size - arena->live_size;
+#if HEAP_QUICK_LIST_DEPTH
+    stats.cached_size      = arena->quick_size;
+    stats.overhead_size   -= arena->quick_size;
+#endif
+    stats.live_count       = arena->live_count;
+    stats.block_count      = arena->block_count;
+    stats.large_count      = arena->large_count;
+    stats.free_chunk_count = arena->free_chunk_count;
+    memcpy(stats.live_histogram, arena->live_histogram, sizeof(stats.live_histogram));
+    memcpy(stats.free_histogram, arena->free_histogram, sizeof(stats.free_histogram));
+
+#ifdef ALLOCATORS_TLSF
+    // note: chunks of one class aren't sorted, so the limit of the highest non empty class is reported instead of walking its list,
+    // a single free chunk is exactly free_size
+    if (arena->free_first_level) {
+        int64_t first = HeapHighestBit(arena->free_first_level);
+        int64_t second = HeapHighestBit(arena->free_second_level[first]);
+        stats.largest_free_chunk = HeapTLSFClassLimit(first, second);
+        if (stats.largest_free_chunk > arena->free_size) {
+            stats.largest_free_chunk = arena->free_size;
+        }
+    }
+#else
+    stats.largest_free_chunk = arena->largest_free_size;
+#endif
+    if (stats.free_size) {
+        stats.fragmentation = 1.0 - (double)stats.largest_free_chunk / stats.free_size;
+    }
+    return stats;
+}
+
+void HeapArenaDump(HeapArena *arena) {
+    PRINT("------------Temporary Arena Dump---------------\n");
+    int64_t block_count = 0;
+    MemoryBlock *block = arena->first_block;
+    while(block) {
+        block_count += 1;
+        block = block->next;
+    }
+    PRINT("Block count: %lld\n", block_count);
+
+    block = arena->first_block;
+    while(block) {
+        PRINT("Block(ptr=%p):\n", block);
+        AllocationNode *node = SkipMemoryBlockHeader(block);
+        while(AllocationNodeSize(node)) {
+            PRINT("\tNode(size=%lld, occupied=%d, ptr=%p)\n", AllocationNodeSize(node), AllocationNodeOccupied(node), node); 
+            node = GetNextNode(node);
+        }
+        block = block->next;
+    }
+
+#ifdef ALLOCATORS_TLSF
+    PRINT("Free lists:\n");
+    for (int64_t first = 0; first < HEAP_TLSF_FIRST_LEVEL_COUNT; ++first) {
+        for (int64_t second = 0; second < HEAP_TLSF_SECOND_LEVEL_COUNT; ++second) {
+            if (!arena->free_lists[first][second]) {
+                continue;
+            }
+            PRINT("\tClass(%lld, %lld):", (long long)first, (long long)second);
+            for (AllocationNode *node = arena->free_lists[first][second]; node; node = node->next) {
+                PRINT(" %lld", (long long)AllocationNodeSize(node));
+            }
+            PRINT("\n");
+        }
+    }
+#else
+    PRINT("Tree:\n");
+    RBT_Dump(arena->root);
+#endif
+}
+
+// red-black tree of any count of nodes that fits into memory is less deep, deeper walk means the links make a cycle
+#define HEAP_VALIDATE_MAX_DEPTH 128
+
+static inline HeapArenaValidation HeapValidateError(const char *error, void *memory) {
+    HeapArenaValidation result = {0};
+    result.error  = error;
+    result.memory = memory;
+    return result;
+}
+
+static inline AllocationNode *HeapValidateFence(MemoryBlock *block) {
+    return (AllocationNode*)((uint8_t*)block + block->size - ALLOCATION_NODE_HEADER_SIZE);
+}
+
+#ifdef ALLOCATORS_TLSF
+// note: black_height is there only for the tree, so both indexes are validated by the same call
+static const char *HeapValidateFreeNode(HeapArena *arena, AllocationNode *node, int64_t black_height) {
+    (void)black_height;
+    int64_t first = 0, second = 0;
+    HeapTLSFMapping(AllocationNodeSize(node), &first, &second);
+    if (node->previous ? node->previous->next != node : arena->free_lists[first][second] != node) {
+        return "Free chunk isn't in the list of its class";
+    }
+    if (node->next && node->next->previous != node) {
+        return "Next chunk of the free list doesn't point back";
+    }
+    if (!((arena->free_second_level[first] >> second) & 1) || !((arena->free_first_level >> first) & 1)) {
+        return "Class of the free chunk isn't marked in the bitmaps";
+    }
+    return 0;
+}
+#else
+// blacks on the path from the root to its leftmost node, path to every missing child should have as many
+static int64_t HeapValidateBlackHeight(AllocationNode *root) {
+    int64_t black_height = 0;
+    for (int64_t depth = 0; root && depth < HEAP_VALIDATE_MAX_DEPTH; ++depth) {
+        black_height += root->color == RBT_BLACK;
+        root = root->left;
+    }
+    return black_height;
+}
+
+// note: node is compared with every ancestor, not only with its parent, so the whole tree is in order once every free chunk passed the check
+static const char *HeapValidateFreeNode(HeapArena *arena, AllocationNode *node, int64_t black_height) {
+    if (node->color != RBT_RED && node->color != RBT_BLACK) {
+        return "Free chunk has no color";
+    }
+    if ((node->left && node->left->parent != node) || (node->right && node->right->parent != node)) {
+        return "Child of the free chunk doesn't point back";
+    }
+    if (node->color == RBT_RED && ((node->left && node->left->color == RBT_RED) || (node->right && node->right->color == RBT_RED))) {
+        return "Red node has a red child";
+    }
+
+    int64_t black_count = node->color == RBT_BLACK;
+    int64_t depth = 0;
+    AllocationNode *child = node;
+    for (AllocationNode *ancestor = node->parent; ancestor; ancestor = ancestor->parent) {
+        if (++depth > HEAP_VALIDATE_MAX_DEPTH) {
+            return "Parent links of the tree make a cycle";
+        }
+        if (ancestor->left == child) {
+            if (!RBT_NodeLess(node, ancestor)) {
+                return "Free chunk is out of order in the tree";
+            }
+        } else if (ancestor->right == child) {
+            if (!RBT_NodeLess(ancestor, node)) {
+                return "Free chunk is out of order in the tree";
+            }
+        } else {
+            return "Parent doesn't point to its child";
+        }
+        black_count += ancestor->color == RBT_BLACK;
+        child = ancestor;
+    }
+    if (child != arena->root) {
+        return "Free chunk isn't in the tree";
+    }
+    if ((!node->left || !node->right) && black_count != black_height) {
+        return "Paths of the tree have different count of black nodes";
+    }
+    return 0;
+}
+
+// in-order successor, null after the last node or if the links make a cycle
+static AllocationNode *HeapValidateTreeNext(AllocationNode *node) {
+    int64_t depth = 0;
+    if (node->right) {
+        node = node->right;
+        while (node->left && ++depth < HEAP_VALIDATE_MAX_DEPTH) {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent && node->parent->right == node && ++depth < HEAP_VALIDATE_MAX_DEPTH) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+#endif
+
+static const char *HeapValidateBlock(MemoryBlock *block) {
+    if (((uintptr_t)block & (ALLOCATION_GRANULARITY - 1)) || (block->size & (ALLOCATION_GRANULARITY - 1))) {
+        return "Block is misaligned";
+    }
+    if (block->size < (int64_t)sizeof(MemoryBlock) + 2*ALLOCATION_NODE_HEADER_SIZE + ALLOCATION_NODE_MIN_SIZE) {
+        return "Block is too small to hold a chunk";
+    }
+    if (HeapValidateFence(block)->size != ALLOCATION_NODE_OCCUPIED) {
+        return "Block isn't terminated";
+    }
+    if (SkipMemoryBlockHeader(block)->previous_size) {
+        return "First chunk of the block has a previous chunk";
+    }
+    return 0;
+}
+
+// note: sizes are checked against the block before they are followed, so a broken boundary tag is reported instead of leading the walk out of the block
+static const char *HeapValidateChunk(HeapArena *arena, MemoryBlock *block, AllocationNode *node, int64_t black_height) {
+    int64_t size = AllocationNodeSize(node);
+    if (node->size & ALLOCATION_NODE_FLAGS & ~(ALLOCATION_NODE_OCCUPIED | ALLOCATION_NODE_SAMPLED)) {
+        return "Chunk has flags of the other kind of memory";
+    }
+    if (size < ALLOCATION_NODE_MIN_SIZE) {
+        return "Chunk is smaller than the minimal size";
+    }
+    if (size > (uint8_t*)HeapValidateFence(block) - (uint8_t*)SkipAllocationNode(node)) {
+        return "Chunk crosses the end of its block";
+    }
+    if (node->previous_size && (node->previous_size < 0 || node->previous_size > (uint8_t*)node - (uint8_t*)SkipAllocationNode(SkipMemoryBlockHeader(block)))) {
+        return "Previous chunk starts before its block";
+    }
+    AllocationNode *next = GetNextNode(node);
+    if (next->previous_size != size) {
+        return "Next chunk doesn't point back";
+    }
+    if (AllocationNodeOccupied(node)) {
+        return 0;
+    }
+
+    AllocationNode *previous = GetPreviousNode(node);
+    if (node->size != size) {
+        return "Free chunk has flags";
+    }
+    if (!AllocationNodeOccupied(next) || (previous && !AllocationNodeOccupied(previous))) {
+        return "Adjacent free chunks are not coalesced";
+    }
+    return HeapValidateFreeNode(arena, node, black_height);
+}
+
+// cheap checks of the statistics, which hold at any moment
+static const char *HeapValidateCounters(HeapArena *arena) {
+    int64_t free_chunk_count = 0, live_count = 0;
+    for (int64_t i = 0; i < HEAP_STATS_BUCKET_COUNT; ++i) {
+        free_chunk_count += arena->free_histogram[i];
+        live_count += arena->live_histogram[i];
+    }
+    if (free_chunk_count != arena->free_chunk_count) {
+        return "Free chunk histogram doesn't match the free chunk count";
+    }
+    if (live_count != arena->live_count) {
+        return "Live histogram doesn't match the live count";
+    }
+    if (arena->free_size < 0 || arena->live_size < 0 || arena->free_size + arena->live_size > arena->allocated_size) {
+        return "Free and live sizes don't fit into the allocated size";
+    }
+    if (!arena->first_block != !arena->last_block || (arena->last_block && arena->last_block->next)) {
+        return "Last block isn't the end of the block list";
+    }
+    return 0;
+}
+
+HeapArenaValidation HeapArenaValidateStep(HeapArena *arena, int64_t chunk_budget) {
+    HeapArenaValidation result = {0};
+#ifdef ALLOCATORS_TLSF
+    int64_t black_height = 0;
+#else
+    int64_t black_height = HeapValidateBlackHeight(arena->root);
+#endif
+    MemoryBlock *block = arena->validate_block ? arena->validate_block : arena->first_block;
+    AllocationNode *node = arena->validate_block ? arena->validate_node : 0;
+    while (block && chunk_budget > 0) {
+        if (!node) {
+            const char *error = HeapValidateBlock(block);
+            if (error) {
+                return HeapValidateError(error, block);
+            }
+            node = SkipMemoryBlockHeader(block);
+        }
+        AllocationNode *fence = HeapValidateFence(block);
+        for (; node != fence && chunk_budget > 0; --chunk_budget) {
+            const char *error = HeapValidateChunk(arena, block, node, black_height);
+            if (error) {
+                return HeapValidateError(error, node);
+            }
+            node = GetNextNode(node);
+        }
+        if (node == fence) {
+            block = block->next;
+            node = 0;
+        }
+    }
+    arena->validate_block = block;
+    arena->validate_node  = node;
+
+    if (!block) {
+        result.finished = true;
+        result.error = HeapValidateCounters(arena);
+        result.memory = result.error ? arena : 0;
+    }
+    return result;
+}
+
+HeapArenaValidation HeapArenaValidate(HeapArena *arena) {
+    const char *error = HeapValidateCounters(arena);
+    if (error) {
+        return HeapValidateError(error, arena);
+    }
+#ifdef ALLOCATORS_TLSF
+    int64_t black_height = 0;
+#else
+    int64_t black_height = HeapValidateBlackHeight(arena->root);
+#endif
+
+    int64_t allocated_size   = 0;
+    int64_t free_size        = 0;
+    int64_t block_count      = 0;
+    int64_t large_count      = 0;
+    int64_t free_chunk_count = 0;
+    int64_t free_histogram[HEAP_STATS_BUCKET_COUNT] = {0};
+    for (MemoryBlock *block = arena->first_block; block; block = block->next) {
+        if (++block_count > arena->block_count) {
+            return HeapValidateError("Block list is longer than the block count", block);
+        }
+        error = HeapValidateBlock(block);
+        if (error) {
+            return HeapValidateError(error, block);
+        }
+        allocated_size += block->size;
+
+        AllocationNode *fence = HeapValidateFence(block);
+        for (AllocationNode *node = SkipMemoryBlockHeader(block); node != fence; node = GetNextNode(node)) {
+            error = HeapValidateChunk(arena, block, node, black_height);
+            if (error) {
+                return HeapValidateError(error, node);
+            }
+            if (!AllocationNodeOccupied(node)) {
+                free_size += node->size;
+                free_chunk_count += 1;
+                free_histogram[HeapStatsBucket(node->size)] += 1;
+            }
+        }
+        if (!block->next && block != arena->last_block) {
+            return HeapValidateError("Last block isn't the end of the block list", block);
+        }
+    }
+
+    // note: every free chunk of the blocks is in the index, so the index holds nothing else if the counts match
+#ifdef ALLOCATORS_TLSF
+    int64_t index_count = 0;
+    for (int64_t first = 0; first < HEAP_TLSF_FIRST_LEVEL_COUNT; ++first) {
+        for (int64_t second = 0; second < HEAP_TLSF_SECOND_LEVEL_COUNT; ++second) {
+            AllocationNode *list = arena->free_lists[first][second];
+            if (((arena->free_second_level[first] >> second) & 1) != (list != 0)) {
+                return HeapValidateError("Second level bitmap doesn't match the lists", arena);
+            }
+            for (AllocationNode *node = list; node; node = node->next) {
+                int64_t node_first = 0, node_second = 0;
+                HeapTLSFMapping(AllocationNodeSize(node), &node_first, &node_second);
+                if (node_first != first || node_second != second) {
+                    return HeapValidateError("Free chunk is in the list of the other class", node);
+                }
+                if (++index_count > free_chunk_count) {
+                    return HeapValidateError("Free lists hold more chunks than the blocks", node);
+                }
+            }
+        }
+        if (((arena->free_first_level >> first) & 1) != (arena->free_second_level[first] != 0)) {
+            return HeapValidateError("First level bitmap doesn't match the second level", arena);
+        }
+    }
+#else
+    int64_t index_count = 0;
+    if (arena->root && arena->root->parent) {
+        return HeapValidateError("Root of the tree has a parent", arena->root);
+    }
+    AllocationNode *node = arena->root;
+    for (int64_t depth = 0; node && node->left && depth < HEAP_VALIDATE_MAX_DEPTH; ++depth) {
+        node = node->left;
+    }
+    AllocationNode *previous = 0;
+    for (; node; previous = node, node = HeapValidateTreeNext(node)) {
+        if (++index_count > free_chunk_count) {
+            return HeapValidateError("Tree holds more chunks than the blocks", node);
+        }
+        if (previous && !RBT_NodeLess(previous, node)) {
+            return HeapValidateError("Tree is out of order", node);
+        }
+    }
+    if ((previous ? AllocationNodeSize(previous) : 0) != arena->largest_free_size) {
+        return HeapValidateError("Largest free size doesn't match the tree", arena);
+    }
+#endif
+    if (index_count != free_chunk_count) {
+        return HeapValidateError("Free index doesn't hold every free chunk", arena);
+    }
+
+    for (HeapLargeAllocation *large = arena->large_allocations; large; large = large->next) {
+        if (++large_count > arena->large_count) {
+            return HeapValidateError("Large allocation list is longer than the large count", large);
+        }
+        if (large->previous ? large->previous->next != large : arena->large_allocations != large) {
+            return HeapValidateError("Large allocation list links are broken", large);
+        }
+        if ((large->size & (ALLOCATION_NODE_OCCUPIED | ALLOCATION_NODE_LARGE)) != (ALLOCATION_NODE_OCCUPIED | ALLOCATION_NODE_LARGE) ||
+            (large->size & ~(int64_t)ALLOCATION_NODE_FLAGS) != large->mapped_size - HeapLargeOffset(large)) {
+            return HeapValidateError("Large allocation has an invalid header", large);
+        }
+        allocated_size += large->mapped_size;
+    }
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    for (HeapDebugGuarded *guarded = arena->guarded_allocations; guarded; guarded = guarded->next) {
+        if (++large_count > arena->large_count) {
+            return HeapValidateError("Guarded allocation list is longer than the large count", guarded);
+        }
+        if (guarded->previous ? guarded->previous->next != guarded : arena->guarded_allocations != guarded) {
+            return HeapValidateError("Guarded allocation list links are broken", guarded);
+        }
+        allocated_size += guarded->mapped_size;
+    }
+#endif
+
+    int64_t slab_count = 0;
+    for (int64_t index = 0; index < HEAP_SLAB_CLASS_COUNT; ++index) {
+        for (HeapSlab *slab = arena->slabs[index]; slab; slab = slab->next) {
+            if (++slab_count > arena->allocated_size / HEAP_SLAB_SIZE) {
+                return HeapValidateError("Slab lists hold more slabs than the arena", slab);
+            }
+            if (slab->previous ? slab->previous->next != slab : arena->slabs[index] != slab) {
+                return HeapValidateError("Slab list links are broken", slab);
+            }
+            if (slab->arena != arena || slab->class_index != index || slab->slot_size != HEAP_SLAB_CLASS_SIZES[index] + HEAP_SLAB_TAG_SIZE) {
+                return HeapValidateError("Slab is in the list of the other class or arena", slab);
+            }
+            if (slab->used_count < 0 || slab->used_count >= slab->capacity || slab->cursor > slab->end ||
+                !AllocationNodeOccupied(GetAllocationNode(slab))) {
+                return HeapValidateError("Slab with free slots has invalid state", slab);
+            }
+        }
+    }
 
-    AllocationNode *next = info->next_in_order;
-    if (next && !next->occupied && (next->memory_block == info->memory_block)) {
-        assert(next->previous_in_order == info);
-        arena->free_size += sizeof(AllocationNode);
-        info->size = info->size + sizeof(AllocationNode) + next->size;
-        info->next_in_order = next->next_in_order;
-        if (info->next_in_order) {
-            info->next_in_order->previous_in_order = info;
-        } else {
-            assert(arena->last_node == next);
-            arena->last_node = info;
+#if HEAP_QUICK_LIST_DEPTH
+    int64_t quick_size = 0;
+    for (int64_t index = 0; index < HEAP_QUICK_LIST_COUNT; ++index) {
+        int64_t quick_count = 0;
+        for (AllocationNode *cached = arena->quick_lists[index]; cached; cached = cached->next) {
+            if (++quick_count > arena->quick_counts[index]) {
+                return HeapValidateError("Quick list is longer than its count", cached);
+            }
+            if (!AllocationNodeOccupied(cached) || HeapQuickListIndex(AllocationNodeSize(cached)) != index) {
+                return HeapValidateError("Cached chunk is free or in the wrong quick list", cached);
+            }
+            quick_size += AllocationNodeSize(cached);
         }
-        arena->root = RBT_RemoveSize(arena->root, next);
-        RBT_ResetNode(next);
-    } 
+        if (quick_count != arena->quick_counts[index]) {
+            return HeapValidateError("Quick list is shorter than its count", arena);
+        }
+    }
+    if (quick_size != arena->quick_size) {
+        return HeapValidateError("Quick lists don't match their size", arena);
+    }
+#endif
+
+    if (allocated_size != arena->allocated_size) {
+        return HeapValidateError("Blocks and large allocations don't match the allocated size", arena);
+    }
+    if (free_size != arena->free_size) {
+        return HeapValidateError("Free chunks don't match the free size", arena);
+    }
+    if (block_count != arena->block_count || large_count != arena->large_count || free_chunk_count != arena->free_chunk_count) {
+        return HeapValidateError("Walk doesn't match the block, large or free chunk count", arena);
+    }
+    if (memcmp(free_histogram, arena->free_histogram, sizeof(free_histogram)) != 0) {
+        return HeapValidateError("Free chunks don't match the free histogram", arena);
+    }
 
-    AllocationNode *previous = info->previous_in_order;
-    if (previous && !previous->occupied && (previous->memory_block == info->memory_block)) {
-        assert(previous->next_in_order == info);
-        arena->free_size += sizeof(AllocationNode);
-        previous->size = previous->size + sizeof(AllocationNode) + info->size;
-        previous->next_in_order = info->next_in_order;
-        if (previous->next_in_order) {
-            previous->next_in_order->previous_in_order = previous;
+    HeapArenaValidation result = {0};
+    result.finished = true;
+    return result;
+}
+
+static inline bool HeapArenaIsBlockFree(MemoryBlock *block) {
+    AllocationNode *node = SkipMemoryBlockHeader(block);
+    return !AllocationNodeOccupied(node) && !AllocationNodeSize(GetNextNode(node));
+}
+
+int64_t HeapArenaTrim(HeapArena *arena, int64_t keep_bytes) {
+    int64_t released_size = 0;
+#if HEAP_QUICK_LIST_DEPTH
+    // note: cached chunks keep their blocks from becoming free, they are given back to the index before the walk
+    HeapQuickListFlushAll(arena);
+#endif
+
+    MemoryBlock *previous = 0;
+    MemoryBlock *block = arena->first_block;
+    while(block) {
+        MemoryBlock *next = block->next;
+        AllocationNode *node = SkipMemoryBlockHeader(block);
+
+        bool keep_block = !HeapArenaIsBlockFree(block) || arena->free_size - node->size < keep_bytes;
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+        keep_block = keep_block || block == arena->reserved_block;
+#endif
+        if (keep_block) {
+            previous = block;
+            block = next;
+            continue;
+        }
+
+        HeapArenaRemoveFreeNode(arena, node);
+        arena->free_size -= node->size;
+        arena->allocated_size -= block->size;
+        arena->block_count -= 1;
+        released_size += block->size;
+
+        if (previous) {
+            previous->next = next;
         } else {
-            assert(arena->last_node == info);
-            arena->last_node = previous;
+            arena->first_block = next;
         }
-        arena->root = RBT_RemoveSize(arena->root, previous);
-        RBT_ResetNode(previous);
-        info = previous;
-    } 
+        if (arena->last_block == block) {
+            arena->last_block = previous;
+        }
+        if (arena->validate_block == block) {
+            arena->validate_block = next;
+            arena->validate_node = 0;
+        }
+
+#ifdef ALLOCATORS_THREAD_SAFE
+        HeapPageMapSet(block, block->size, 0);
+#endif
+        PlatformFreeMemory(block, block->size);
+        block = next;
+    }
 
-    arena->root = RBT_AddNode(arena->root, info);
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+    released_size += HeapArenaShrinkReserved(arena, keep_bytes);
+#endif
+    return released_size;
 }
 
-// Note: from what i've seen, this function is not vectorized by the compiler
-void HeapArenaCopyMemory(void *dest, void *source, int64_t size) {
-    int64_t start = 0;
-    int64_t end  =  size;
-    int64_t step = 1;
-    if (dest > source) {
-        start = size - 1;
-        end =  -1;
-        step = -1; 
+void HeapArenaRelease(HeapArena *arena) {
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileReleaseArena(arena);
+#endif
+    while (arena->large_allocations) {
+        HeapLargeFree(arena, arena->large_allocations + 1);
     }
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    while (arena->guarded_allocations) {
+        HeapDebugFreeGuarded(arena, (uint8_t*)(arena->guarded_allocations + 1) + HEAP_DEBUG_HEADER_SIZE);
+    }
+#endif
 
-    uint8_t *to   = (uint8_t*)dest;
-    uint8_t *from = (uint8_t*)source;
-    for (int64_t i=start; i != end; i+=step) {
-        to[i] = from[i]; 
+    MemoryBlock *block = arena->first_block;
+    while(block) {
+        MemoryBlock *next = block->next;
+        assert(block != next);
+#ifdef ALLOCATORS_THREAD_SAFE
+        HeapPageMapSet(block, block->size, 0);
+#endif
+#ifdef ALLOCATORS_CONTIGUOUS_HEAP
+        if (block == arena->reserved_block) {
+            PlatformFreeMemory(block, HEAP_ARENA_RESERVE_SIZE);
+            block = next;
+            continue;
+        }
+#endif
+        PlatformFreeMemory(block, block->size);
+        block = next;
     }
+
+    memset(arena, 0, sizeof(HeapArena));
 }
 
-void *HeapArenaRealloc(HeapArena *arena, void *memory, int64_t new_size) {
-    assert(arena->first_block && "Nothing is allocated yet");
+#ifdef ALLOCATORS_THREAD_SAFE
+struct ThreadHeap {
+    HeapArena arena; // note: should be the first field, page map and slabs know only about the arena
+    void *volatile remote_free; // memory freed by the other threads, next pointer is stored in the memory itself
+    ThreadHeap *next; // all heaps ever created, see heap_registry
+    volatile int32_t owned;
+};
 
-    AllocationNode *node = GetAllocationNode(memory);
-    int64_t old_size = node->used_size;
+// Registry keeps every heap alive for the whole lifetime of the process: when a thread exits its heap is handed to the next thread that asks for one,
+// so memory that still lives in the heap and frees queued to it are not lost
+typedef struct HeapRegistry HeapRegistry;
+struct HeapRegistry {
+    volatile int32_t lock;
+    ThreadHeap *heaps;
+};
 
-    if (old_size == new_size) {
-        return memory;
+static HeapRegistry heap_registry;
+static ALLOCATORS_THREAD_LOCAL ThreadHeap *thread_heap;
+
+static inline void HeapRegistryLock(void) {
+    while (!AtomicCompareExchange32(&heap_registry.lock, 0, 1)) {
+        // note: heaps are acquired and released only when threads start and exit, so the lock is almost never contended
     }
-    // volatile: make sure that it won't change contents of the node
-    HeapArenaFree(arena, memory);
-     
-    AllocationNode *new_node = HeapArenaGetNode(arena, new_size);
-    void *new_memory = SkipAllocationNode(new_node);
-    if (new_memory != memory) {
-        int64_t saved_size = old_size;
-        if (old_size > new_size) {
-            saved_size = new_size;
+}
+
+static inline void HeapRegistryUnlock(void) {
+    AtomicStore32(&heap_registry.lock, 0);
+}
+
+static void ThreadHeapDrainRemoteFree(ThreadHeap *heap) {
+    void *memory = AtomicExchangePointer(&heap->remote_free, 0);
+    while (memory) {
+        void *next = *(void**)memory;
+        HeapArenaFree(&heap->arena, memory);
+        memory = next;
+    }
+}
+
+static ThreadHeap *ThreadHeapAcquire(void) {
+    HeapRegistryLock();
+    ThreadHeap *heap = heap_registry.heaps;
+    while (heap && heap->owned) {
+        heap = heap->next;
+    }
+    if (!heap) {
+        heap = PlatformGetMemory(sizeof(ThreadHeap));
+        if (!heap) {
+            HeapRegistryUnlock();
+            return 0;
         }
-        HeapArenaCopyMemory(new_memory, memory, saved_size);
+        memset(heap, 0, sizeof(ThreadHeap));
+        heap->next = heap_registry.heaps;
+        heap_registry.heaps = heap;
     }
-    HeapArenaSeparateExtraMemory(arena, new_node); 
-    return new_memory;
+    heap->owned = 1;
+    HeapRegistryUnlock();
+
+    ThreadHeapDrainRemoteFree(heap);
+    thread_heap = heap;
+    return heap;
 }
 
-void HeapArenaDump(HeapArena *arena) {
-    PRINT("------------Temporary Arena Dump---------------\n");
-    int64_t block_count = 0;
-    MemoryBlock *block = arena->first_block;
-    while(block) {
-        block_count += 1;
-        block = block->next;
+static inline ThreadHeap *ThreadHeapGet(void) {
+    ThreadHeap *heap = thread_heap;
+    if (!heap) {
+        heap = ThreadHeapAcquire();
+        if (!heap) {
+            return 0;
+        }
     }
-    PRINT("Block count: %lld\n", block_count);
+    if (AtomicLoadPointer(&heap->remote_free)) {
+        ThreadHeapDrainRemoteFree(heap);
+    }
+    return heap;
+}
 
-    int64_t node_count = 0;
-    AllocationNode *node = arena->first_node;
-    while(node) {
-        node_count += 1;
-        node = node->next_in_order;
+static inline ThreadHeap *ThreadHeapGetOwner(void *memory) {
+    HeapArena *arena = 0;
+    if (HeapArenaIsSlabMemory(memory)) {
+        arena = HeapSlabFromMemory(memory)->arena;
+    } else {
+        arena = HeapPageMapGet(memory);
     }
-    PRINT("Nodes(%lld):\n", node_count);
-    node = arena->first_node;
-    while(node) {
-        PRINT("\tNode(size=%lld, occupied=%d, ptr=%p)\n", node->size, node->occupied, node); 
-        node = node->next_in_order;
+    assert(arena && "Memory doesn't belong to any heap");
+    return (ThreadHeap*)arena;
+}
+
+static inline void ThreadHeapPushRemoteFree(ThreadHeap *heap, void *memory) {
+    void *head = 0;
+    do {
+        head = AtomicLoadPointer(&heap->remote_free);
+        *(void**)memory = head;
+    } while (!AtomicCompareExchangePointer(&heap->remote_free, head, memory));
+}
+
+void *ThreadHeapAllocate(int64_t size) {
+    ThreadHeap *heap = ThreadHeapGet();
+    if (!heap) {
+        return 0;
     }
+    return HeapArenaAllocate(&heap->arena, size);
+}
 
-    PRINT("Tree:\n");
-    RBT_Dump(arena->root);
+void *ThreadHeapAllocateAligned(int64_t size, int64_t alignment) {
+    ThreadHeap *heap = ThreadHeapGet();
+    if (!heap) {
+        return 0;
+    }
+    return HeapArenaAllocateAligned(&heap->arena, size, alignment);
 }
 
-void HeapArenaRelease(HeapArena *arena) {
-    MemoryBlock *block = arena->first_block;
-    while(block) {
-        MemoryBlock *next = block->next;
-        assert(block != next);
-        PlatformFreeMemory(block);
-        block = next;
+void ThreadHeapFree(void *memory) {
+    ThreadHeap *owner = ThreadHeapGetOwner(memory);
+    if (owner == thread_heap) {
+        HeapArenaFree(&owner->arena, memory);
+        return;
     }
+    ThreadHeapPushRemoteFree(owner, memory);
+}
 
-    memset(arena, 0, sizeof(HeapArena));
+void *ThreadHeapRealloc(void *memory, int64_t new_size) {
+    ThreadHeap *heap  = ThreadHeapGet();
+    if (!heap) {
+        return 0;
+    }
+    ThreadHeap *owner = ThreadHeapGetOwner(memory);
+    if (owner == heap) {
+        return HeapArenaRealloc(&heap->arena, memory, new_size);
+    }
+
+    // note: size of the occupied memory is never changed by its owner, so it is safe to read it from the other thread
+    int64_t saved_size = HeapArenaUsableSize(memory);
+    if (saved_size > new_size) {
+        saved_size = new_size;
+    }
+    // note: memory stays with the caller if there is nothing to move it to, same as realloc
+    void *new_memory = HeapArenaAllocate(&heap->arena, new_size);
+    if (!new_memory) {
+        return 0;
+    }
+    HeapArenaCopyMemory(new_memory, memory, saved_size);
+    ThreadHeapPushRemoteFree(owner, memory);
+    return new_memory;
+}
+
+void ThreadHeapRelease(void) {
+    ThreadHeap *heap = thread_heap;
+    if (!heap) {
+        return;
+    }
+    ThreadHeapDrainRemoteFree(heap);
+
+    thread_heap = 0;
+    HeapRegistryLock();
+    heap->owned = 0;
+    HeapRegistryUnlock();
 }
+#endif
 
+// Static arena takes memory in pages, which are linked into a list and kept until StaticArenaDestroy, so the arena doesn't touch malloc after reset.
+// The first page is STATIC_ARENA_PAGE_TOTAL_SIZE bytes, every next one is STATIC_ARENA_GROWTH_FACTOR times bigger, up to STATIC_ARENA_MAX_PAGE_SIZE,
+// so big workloads end up in a few big pages. Requests that don't fit into a regular page get a dedicated page of their own size.
+// These are the defaults of a zero-initialized arena, StaticArenaInit sets them per arena
 #ifndef STATIC_ARENA_PAGE_TOTAL_SIZE
 #define STATIC_ARENA_PAGE_TOTAL_SIZE 1024 * 1024
 #endif
-#define STATIC_ARENA_PAGE_AVAILABLE_SIZE (STATIC_ARENA_PAGE_TOTAL_SIZE - sizeof(uint8_t*))
+#ifndef STATIC_ARENA_MAX_PAGE_SIZE
+#define STATIC_ARENA_MAX_PAGE_SIZE 64 * 1024 * 1024
+#endif
+#ifndef STATIC_ARENA_GROWTH_FACTOR
+#define STATIC_ARENA_GROWTH_FACTOR 2
+#endif
+
+typedef struct StaticArenaPage StaticArenaPage;
+struct StaticArenaPage {
+    StaticArenaPage *next;
+    int64_t size; // available for allocations, excluding this header
+};
+
+#define STATIC_ARENA_PAGE_AVAILABLE_SIZE (STATIC_ARENA_PAGE_TOTAL_SIZE - (int64_t)sizeof(StaticArenaPage))
 static_assert(
-    STATIC_ARENA_PAGE_AVAILABLE_SIZE, 
-    "Specified STATIC_ARENA_PAGE_TOTAL_SIZE is too small, expected at least size of a pointer"
+    STATIC_ARENA_PAGE_AVAILABLE_SIZE > 0, 
+    "Specified STATIC_ARENA_PAGE_TOTAL_SIZE is too small, expected more than size of the page header"
 );
 
 // TODO: move these things to the header
 typedef struct StaticArena StaticArena;
 struct StaticArena {
-    uint8_t *first;
-    uint8_t *last;
+    StaticArenaPage *first;
+    StaticArenaPage *last; // page the allocations are taken from
     int64_t current_page_cursor;
 
+    int64_t first_page_size; // including the page header, zero takes STATIC_ARENA_PAGE_TOTAL_SIZE
+    int64_t max_page_size;   // zero takes STATIC_ARENA_MAX_PAGE_SIZE
+    int32_t growth_factor;   // zero takes STATIC_ARENA_GROWTH_FACTOR, 1 keeps every page the same size
+    int64_t next_page_size;  // size of the next regular page, grows with every new page
+
     void     *last_allocated_block;
     int64_t  last_allocation_size;
 };
 
-uint8_t *StaticArenaGetPageBase(uint8_t *page) {
-    return page - sizeof(uint8_t*);
-} 
-
-uint8_t *StaticArenaGetNextPage(uint8_t *page) {
-    uint8_t *base = StaticArenaGetPageBase(page);
-    return (uint8_t*)base; 
+void StaticArenaInit(StaticArena *arena, int64_t first_page_size, int64_t max_page_size, int32_t growth_factor) {
+    assert(!arena->first && "Arena is already in use");
+    assert(first_page_size > (int64_t)sizeof(StaticArenaPage) && "Page should be bigger than its header");
+    assert(max_page_size >= first_page_size);
+    assert(growth_factor >= 1);
+    *arena = (StaticArena){0};
+    arena->first_page_size = first_page_size;
+    arena->max_page_size   = max_page_size;
+    arena->growth_factor   = growth_factor;
 }
 
-uint8_t *StaticArenaNewPage() {
-    uint8_t *mem = malloc(STATIC_ARENA_PAGE_TOTAL_SIZE);   
-    *((uint8_t**)mem) = 0;
-    mem += sizeof(uint8_t*);
-    return mem;
+static inline uint8_t *StaticArenaPageMemory(StaticArenaPage *page) {
+    return (uint8_t*)(page + 1);
 }
 
-void StaticArenaNextPage(StaticArena *arena) {
-    assert(arena->first && arena->last);
+StaticArenaPage *StaticArenaNewPage(int64_t size) {
+    StaticArenaPage *page = malloc(size);
+    assert(page);
+    page->next = 0;
+    page->size = size - sizeof(StaticArenaPage);
+    return page;
+}
 
-    uint8_t *last_page_base = StaticArenaGetPageBase(arena->last);
-    uint8_t *new_page = StaticArenaNewPage();
+// Moves the arena to the page after the current one that can hold size bytes: pages kept from before the reset are reused if they are big enough,
+// otherwise a new page is linked right after the current one
+void StaticArenaNextPage(StaticArena *arena, int64_t size) {
+    StaticArenaPage *next = arena->last ? arena->last->next : arena->first;
+    while (next && next->size < size) {
+        next = next->next;
+    }
 
-    *((uint8_t**)last_page_base) = new_page;
+    if (!next) {
+        if (!arena->first_page_size) {
+            arena->first_page_size = STATIC_ARENA_PAGE_TOTAL_SIZE;
+            arena->max_page_size   = STATIC_ARENA_MAX_PAGE_SIZE;
+            arena->growth_factor   = STATIC_ARENA_GROWTH_FACTOR;
+        }
+        if (!arena->next_page_size) {
+            arena->next_page_size = arena->first_page_size;
+        }
 
-    arena->last = new_page;
-}
+        int64_t page_size = arena->next_page_size;
+        if (size > page_size - (int64_t)sizeof(StaticArenaPage)) {
+            // note: dedicated page doesn't advance the growth, the next regular page is as big as it would be without it
+            page_size = size + sizeof(StaticArenaPage);
+        } else if (arena->next_page_size <= arena->max_page_size / arena->growth_factor) {
+            arena->next_page_size *= arena->growth_factor;
+        } else {
+            arena->next_page_size = arena->max_page_size;
+        }
 
-bool StaticArenaZeroed(StaticArena *arena) {
-    StaticArena zeroed = {0};
-    int32_t res = memcmp(&zeroed, arena, sizeof(StaticArena));
-    if (res != 0) {
-        return false;
+        next = StaticArenaNewPage(page_size);
+        if (arena->last) {
+            next->next = arena->last->next;
+            arena->last->next = next;
+        } else {
+            next->next = arena->first;
+            arena->first = next;
+        }
     }
-    return true;
+
+    arena->last = next;
+    arena->current_page_cursor = 0;
 }
 
 void *StaticArenaAlloc(StaticArena *arena, int64_t size) {
-    bool zeroed = StaticArenaZeroed(arena);
-    if (zeroed) {  
-        arena->first = StaticArenaNewPage();
-        arena->last = arena->first;
-        arena->current_page_cursor = 0;
-    }
-
-    assert(arena->first);
-    assert(arena->last);
-    assert(arena->current_page_cursor <= STATIC_ARENA_PAGE_AVAILABLE_SIZE);
-    assert(size <= STATIC_ARENA_PAGE_AVAILABLE_SIZE);
-
-    int64_t available = STATIC_ARENA_PAGE_AVAILABLE_SIZE - arena->current_page_cursor;
-    if (size > available) {
-        uint8_t *base = StaticArenaGetPageBase(arena->last);
-        uint8_t *next = *((uint8_t**)base);
-        if (next) { 
-            arena->last = next;
-        } else {
-            StaticArenaNextPage(arena);
-        } 
-        arena->current_page_cursor = 0;
+    assert(size >= 0 && "Requested size is less than zero");
+    if (!arena->last || size > arena->last->size - arena->current_page_cursor) {
+        StaticArenaNextPage(arena, size);
     }
     
-    void *elem = arena->last + arena->current_page_cursor;
+    void *elem = StaticArenaPageMemory(arena->last) + arena->current_page_cursor;
 
     arena->last_allocated_block = elem;
     arena->last_allocation_size = size;
     arena->current_page_cursor += size;
 
-    assert(arena->current_page_cursor <= STATIC_ARENA_PAGE_AVAILABLE_SIZE);
+    assert(arena->current_page_cursor <= arena->last->size);
     return elem;
 }
 
@@ -1042,49 +4422,354 @@ void StaticArenaReset(StaticArena *arena) {
 }
 
 void StaticArenaDestroy(StaticArena *arena) {
-    uint8_t *next = arena->first;
+    StaticArenaPage *next = arena->first;
 
     while (next) { 
-        uint8_t *current = next; 
-        uint8_t *base = StaticArenaGetPageBase(current);
-        next = *((uint8_t**)base); 
+        StaticArenaPage *current = next; 
+        next = current->next; 
 
-        free(base);
+        free(current);
     }
+    StaticArenaReset(arena);
+    arena->first = 0;
+    arena->last  = 0;
+    arena->next_page_size = 0;
 }
 
 void *StaticArenaReallocLast(StaticArena *arena, void *block, int64_t new_size) {
     assert(new_size >= 0 && "Requested size is less than zero");
-    assert(new_size <= STATIC_ARENA_PAGE_AVAILABLE_SIZE);
     assert(block == arena->last_allocated_block && "Given pointer doesn't point to the last allocation. Static arena can reallocate only the last block"); 
     int64_t old_size  = arena->last_allocation_size;
     int64_t size_diff = new_size - old_size; 
-    if (size_diff <= 0) {
-        arena->current_page_cursor += size_diff;
-        return arena->last_allocated_block;
-    }
-
-    int64_t available = STATIC_ARENA_PAGE_AVAILABLE_SIZE - arena->current_page_cursor;
+    int64_t available = arena->last->size - arena->current_page_cursor;
     if (size_diff <= available) {
         arena->current_page_cursor += size_diff;
+        arena->last_allocation_size = new_size;
         return arena->last_allocated_block;
     }
 
-    uint8_t *base = StaticArenaGetPageBase(arena->last);
-    uint8_t *next = *((uint8_t**)base);
-    if (next) { 
-        arena->last = next;
-    } else {
-        StaticArenaNextPage(arena);
-    } 
-    arena->current_page_cursor = 0;
-    memcpy(arena->last, block, old_size);
-    arena->current_page_cursor += new_size;
-    arena->last_allocated_block = arena->last;
+    StaticArenaNextPage(arena, new_size);
+    memcpy(StaticArenaPageMemory(arena->last), block, old_size);
+    arena->current_page_cursor = new_size;
+    arena->last_allocated_block = StaticArenaPageMemory(arena->last);
     arena->last_allocation_size  = new_size;
     return arena->last_allocated_block;
 }
 
+// Position of the arena, memory allocated after StaticArenaMark is given back at once by StaticArenaRestore, so nested functions can use
+// the same arena for their temporary memory. Marks should be restored in the reverse order they were taken
+typedef struct StaticArenaCheckpoint StaticArenaCheckpoint;
+struct StaticArenaCheckpoint {
+    StaticArena *arena;
+    StaticArenaPage *page; // zero if nothing was allocated from the arena yet
+    int64_t cursor;
+
+    void    *last_allocated_block; // block allocated before the mark can still be reallocated after the restore
+    int64_t last_allocation_size;
+};
+
+StaticArenaCheckpoint StaticArenaMark(StaticArena *arena) {
+    StaticArenaCheckpoint checkpoint = {
+        .arena  = arena,
+        .page   = arena->last,
+        .cursor = arena->current_page_cursor,
+        .last_allocated_block = arena->last_allocated_block,
+        .last_allocation_size = arena->last_allocation_size,
+    };
+    return checkpoint;
+}
+
+// note: pages are never reordered, new ones are linked right after the current page, so everything allocated after the mark lives at or after its page
+void StaticArenaRestore(StaticArenaCheckpoint checkpoint) {
+    StaticArena *arena = checkpoint.arena;
+    if (!checkpoint.page) {
+        StaticArenaReset(arena);
+        return;
+    }
+    assert(checkpoint.cursor <= checkpoint.page->size);
+    arena->last = checkpoint.page;
+    arena->current_page_cursor  = checkpoint.cursor;
+    arena->last_allocated_block = checkpoint.last_allocated_block;
+    arena->last_allocation_size = checkpoint.last_allocation_size;
+}
+
+// Every thread has STATIC_ARENA_SCRATCH_COUNT scratch arenas. StaticArenaGetScratch marks one that isn't among the given conflicts and returns the mark,
+// give the memory back with StaticArenaRestore. A function that returns its result in a scratch arena passed by the caller lists that arena as a conflict,
+// so its own temporary memory comes from another one and the result isn't overwritten by, or restored together with, the temporary memory
+#ifndef STATIC_ARENA_SCRATCH_COUNT
+#define STATIC_ARENA_SCRATCH_COUNT 2
+#endif
+
+static ALLOCATORS_THREAD_LOCAL StaticArena static_arena_scratch[STATIC_ARENA_SCRATCH_COUNT];
+
+StaticArenaCheckpoint StaticArenaGetScratch(StaticArena **conflicts, int32_t conflict_count) {
+    for (int32_t i = 0; i < STATIC_ARENA_SCRATCH_COUNT; ++i) {
+        StaticArena *arena = &static_arena_scratch[i];
+        bool conflicting = false;
+        for (int32_t j = 0; j < conflict_count; ++j) {
+            if (conflicts[j] == arena) {
+                conflicting = true;
+                break;
+            }
+        }
+        if (!conflicting) {
+            return StaticArenaMark(arena);
+        }
+    }
+    assert(0 && "Every scratch arena conflicts, increase STATIC_ARENA_SCRATCH_COUNT");
+    return (StaticArenaCheckpoint){0};
+}
+
+// Scratch arenas keep their pages for the whole life of the thread, call it before the thread exits to free them
+void StaticArenaReleaseScratch(void) {
+    for (int32_t i = 0; i < STATIC_ARENA_SCRATCH_COUNT; ++i) {
+        StaticArenaDestroy(&static_arena_scratch[i]);
+    }
+}
+
+
+#ifdef ALLOCATORS_LINEAR_ARENA
+// Linear arena reserves one range of address space on the first allocation and commits it by LINEAR_ARENA_COMMIT_SIZE as the cursor advances,
+// so allocation is a pointer bump and a compare, and the last allocation grows in place, whatever its size.
+// Reset decommits everything above the first LINEAR_ARENA_RETAIN_SIZE bytes, so a single big frame doesn't keep its memory forever.
+// These are the defaults of a zero-initialized arena, LinearArenaInit sets the reserve and the retained size per arena
+#ifndef LINEAR_ARENA_RESERVE_SIZE
+#define LINEAR_ARENA_RESERVE_SIZE (int64_t)64*1024*1024*1024
+#endif
+#ifndef LINEAR_ARENA_COMMIT_SIZE
+#define LINEAR_ARENA_COMMIT_SIZE 64*1024
+#endif
+#ifndef LINEAR_ARENA_RETAIN_SIZE
+#define LINEAR_ARENA_RETAIN_SIZE 4*1024*1024
+#endif
+static_assert(LINEAR_ARENA_COMMIT_SIZE % HEAP_ARENA_PAGE_SIZE == 0, "LINEAR_ARENA_COMMIT_SIZE should be a multiple of HEAP_ARENA_PAGE_SIZE");
+
+typedef struct LinearArena LinearArena;
+struct LinearArena {
+    uint8_t *base; // start of the reserved range, zero until the first allocation
+    int64_t cursor;
+    int64_t committed_size;
+
+    // zero-initialized arena takes LINEAR_ARENA_RESERVE_SIZE and LINEAR_ARENA_RETAIN_SIZE on the first allocation
+    int64_t reserved_size;
+    int64_t retained_size; // committed memory kept by reset
+
+    void    *last_allocated_block;
+    int64_t last_allocation_size;
+};
+
+void LinearArenaInit(LinearArena *arena, int64_t reserved_size, int64_t retained_size) {
+    assert(!arena->base && "Arena is already in use");
+    assert(reserved_size > 0 && retained_size >= 0 && retained_size <= reserved_size);
+    *arena = (LinearArena){0};
+    arena->reserved_size = (reserved_size + LINEAR_ARENA_COMMIT_SIZE - 1) & ~((int64_t)LINEAR_ARENA_COMMIT_SIZE - 1);
+    arena->retained_size = retained_size;
+}
+
+// Commits the range up to end, returns false if it is out of the reservation or the platform has no memory
+static bool LinearArenaCommit(LinearArena *arena, int64_t end) {
+    if (!arena->base) {
+        if (!arena->reserved_size) {
+            arena->reserved_size = LINEAR_ARENA_RESERVE_SIZE;
+            arena->retained_size = LINEAR_ARENA_RETAIN_SIZE;
+        }
+        arena->base = PlatformReserveMemory(arena->reserved_size);
+        if (!arena->base) {
+            return false;
+        }
+    }
+    if (end > arena->reserved_size) {
+        return false;
+    }
+
+    int64_t committed_size = (end + LINEAR_ARENA_COMMIT_SIZE - 1) & ~((int64_t)LINEAR_ARENA_COMMIT_SIZE - 1);
+    if (committed_size == arena->committed_size) {
+        return true;
+    }
+    if (!PlatformCommitMemory(arena->base + arena->committed_size, committed_size - arena->committed_size)) {
+        return false;
+    }
+    arena->committed_size = committed_size;
+    return true;
+}
+
+// returns 0 if the reservation is used up or the platform has no memory to commit.
+// Zero size allocation returns the cursor and takes no space, so it is a valid pointer that the next allocation is going to share,
+// the range is reserved on the first allocation whatever its size
+void *LinearArenaAlloc(LinearArena *arena, int64_t size) {
+    assert(size >= 0 && "Requested size is less than zero");
+    int64_t end = arena->cursor + size;
+    if ((end > arena->committed_size || !arena->base) && !LinearArenaCommit(arena, end)) {
+        return 0;
+    }
+
+    void *elem = arena->base + arena->cursor;
+    arena->cursor = end;
+    arena->last_allocated_block = elem;
+    arena->last_allocation_size = size;
+    return elem;
+}
+
+// note: the last block always ends at the cursor, so it is never moved, returns 0 and keeps the block as it was if it can't grow
+void *LinearArenaReallocLast(LinearArena *arena, void *block, int64_t new_size) {
+    assert(new_size >= 0 && "Requested size is less than zero");
+    assert(block == arena->last_allocated_block && "Given pointer doesn't point to the last allocation. Linear arena can reallocate only the last block");
+    int64_t end = arena->cursor - arena->last_allocation_size + new_size;
+    if (end > arena->committed_size && !LinearArenaCommit(arena, end)) {
+        return 0;
+    }
+
+    arena->cursor = end;
+    arena->last_allocation_size = new_size;
+    return block;
+}
+
+void LinearArenaReset(LinearArena *arena) {
+    arena->cursor = 0;
+    arena->last_allocated_block = 0;
+    arena->last_allocation_size = 0;
+
+    int64_t retained_size = (arena->retained_size + LINEAR_ARENA_COMMIT_SIZE - 1) & ~((int64_t)LINEAR_ARENA_COMMIT_SIZE - 1);
+    if (arena->committed_size > retained_size) {
+        PlatformDecommitMemory(arena->base + retained_size, arena->committed_size - retained_size);
+        arena->committed_size = retained_size;
+    }
+}
+
+void LinearArenaDestroy(LinearArena *arena) {
+    if (arena->base) {
+        PlatformFreeMemory(arena->base, arena->reserved_size);
+    }
+    LinearArena destroyed = {0};
+    destroyed.reserved_size = arena->reserved_size;
+    destroyed.retained_size = arena->retained_size;
+    *arena = destroyed;
+}
+#endif
+
+#ifndef POOL_ARENA_SLAB_SIZE
+#define POOL_ARENA_SLAB_SIZE 64*1024
+#endif
+
+void PoolArenaInit(PoolArena *arena, int64_t object_size) {
+    assert(object_size > 0 && "Object size should be positive");
+    memset(arena, 0, sizeof(PoolArena));
+    arena->slot_size = (object_size + sizeof(void*) - 1) & ~(int64_t)(sizeof(void*) - 1);
+    arena->slab_size = HeapArenaRoundToPages(arena->slot_size > POOL_ARENA_SLAB_SIZE ? arena->slot_size : POOL_ARENA_SLAB_SIZE);
+    arena->slot_count = arena->slab_size / arena->slot_size;
+    arena->current_slab = -1;
+}
+
+// note: tables are doubled, so they are copied only log2 of the slab count times
+static void PoolArenaGrowTables(PoolArena *arena) {
+    int64_t capacity = arena->slab_capacity ? arena->slab_capacity * 2 : HEAP_ARENA_PAGE_SIZE / (int64_t)sizeof(uint8_t*);
+    uint8_t **slabs = PlatformGetMemory(capacity * sizeof(uint8_t*));
+    int32_t *sorted_slabs = PlatformGetMemory(capacity * sizeof(int32_t));
+    if (arena->slab_capacity) {
+        memcpy(slabs, arena->slabs, arena->slab_count * sizeof(uint8_t*));
+        memcpy(sorted_slabs, arena->sorted_slabs, arena->slab_count * sizeof(int32_t));
+        PlatformFreeMemory(arena->slabs, arena->slab_capacity * sizeof(uint8_t*));
+        PlatformFreeMemory(arena->sorted_slabs, arena->slab_capacity * sizeof(int32_t));
+    }
+    arena->slabs = slabs;
+    arena->sorted_slabs = sorted_slabs;
+    arena->slab_capacity = capacity;
+}
+
+// returns position of the last slab that starts at or below memory in sorted_slabs, or -1
+static int64_t PoolArenaFindSlab(PoolArena *arena, uint8_t *memory) {
+    int64_t low = 0, high = arena->slab_count;
+    while (low < high) {
+        int64_t middle = (low + high) / 2;
+        if (arena->slabs[arena->sorted_slabs[middle]] <= memory) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low - 1;
+}
+
+static void PoolArenaAddSlab(PoolArena *arena) {
+    assert((arena->slab_count + 1) * arena->slot_count <= (int64_t)UINT32_MAX + 1 && "Slot indices don't fit into 32 bits");
+    if (arena->slab_count == arena->slab_capacity) {
+        PoolArenaGrowTables(arena);
+    }
+    uint8_t *slab = PlatformGetMemory(arena->slab_size);
+    int64_t number = arena->slab_count;
+    arena->slabs[number] = slab;
+
+    int64_t position = PoolArenaFindSlab(arena, slab) + 1;
+    memmove(arena->sorted_slabs + position + 1, arena->sorted_slabs + position, (arena->slab_count - position) * sizeof(int32_t));
+    arena->sorted_slabs[position] = (int32_t)number;
+    arena->slab_count += 1;
+}
+
+void *PoolArenaAllocate(PoolArena *arena) {
+    assert(arena->slot_size && "Arena isn't initialized, see PoolArenaInit");
+    void *res = arena->free_list;
+    if (res) {
+        arena->free_list = *(void**)res;
+    } else {
+        if (arena->cursor == arena->end) {
+            arena->current_slab += 1;
+            if (arena->current_slab == arena->slab_count) {
+                PoolArenaAddSlab(arena);
+            }
+            arena->cursor = arena->slabs[arena->current_slab];
+            arena->end = arena->cursor + arena->slot_count * arena->slot_size;
+        }
+        res = arena->cursor;
+        arena->cursor += arena->slot_size;
+    }
+    arena->used_count += 1;
+    return res;
+}
+
+void PoolArenaFree(PoolArena *arena, void *memory) {
+    if (!memory) {
+        return;
+    }
+    assert(arena->used_count > 0 && "Pool arena has no objects to free");
+    arena->used_count -= 1;
+    *(void**)memory = arena->free_list;
+    arena->free_list = memory;
+}
+
+void PoolArenaReset(PoolArena *arena) {
+    arena->free_list = 0;
+    arena->cursor = 0;
+    arena->end = 0;
+    arena->current_slab = -1;
+    arena->used_count = 0;
+}
+
+void PoolArenaRelease(PoolArena *arena) {
+    for (int64_t i = 0; i < arena->slab_count; ++i) {
+        PlatformFreeMemory(arena->slabs[i], arena->slab_size);
+    }
+    if (arena->slab_capacity) {
+        PlatformFreeMemory(arena->slabs, arena->slab_capacity * sizeof(uint8_t*));
+        PlatformFreeMemory(arena->sorted_slabs, arena->slab_capacity * sizeof(int32_t));
+    }
+    memset(arena, 0, sizeof(PoolArena));
+}
+
+uint32_t PoolArenaGetIndex(PoolArena *arena, void *memory) {
+    int64_t position = PoolArenaFindSlab(arena, memory);
+    assert(position >= 0 && "Memory doesn't belong to the arena");
+    int64_t number = arena->sorted_slabs[position];
+    int64_t offset = (uint8_t*)memory - arena->slabs[number];
+    assert(offset < arena->slot_count * arena->slot_size && "Memory doesn't belong to the arena");
+    assert(offset % arena->slot_size == 0 && "Memory doesn't point to the beginning of an object");
+    return (uint32_t)(number * arena->slot_count + offset / arena->slot_size);
+}
+
+void *PoolArenaFromIndex(PoolArena *arena, uint32_t index) {
+    int64_t number = index / arena->slot_count;
+    assert(number < arena->slab_count && "Index is out of the arena");
+    return arena->slabs[number] + (index % arena->slot_count) * arena->slot_size;
+}
 
 #undef PRINT_INDENT
 #undef PRINT
@@ -1,3 +1,6 @@
 CL examples/windows/usage.c     -I"./" /Fo:build/usage     /Fe:build/usage /Z7
 CL examples/windows/heap_test.c -I"./" /Fo:build/heap_test /Fe:build/heap_test /O2 /Z7
 CL examples/windows/static_test.c -I"./" /Fo:build/static_test /Fe:build/static_test /O2 /Z7
+CL examples/windows/thread_test.c -I"./" /Fo:build/thread_test /Fe:build/thread_test /O2 /Z7
+CL examples/windows/linear_test.c -I"./" /Fo:build/linear_test /Fe:build/linear_test /O2 /Z7
+CL examples/windows/pool_test.c -I"./" /Fo:build/pool_test /Fe:build/pool_test /O2 /Z7
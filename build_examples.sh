@@ -0,0 +1,6 @@
+cc examples/linux/usage.c -I"./" -o build/usage -g
+cc -shared -fPIC examples/linux/malloc_shim.c -I"./" -o build/liballocators_malloc.so -O2 -pthread
+cc examples/linux/benchmark.c -I"./" -o build/benchmark -O2 -pthread
+cc -shared -fPIC examples/linux/malloc_shim.c -I"./" -o build/liballocators_malloc_trace.so -O2 -pthread -DALLOCATORS_TRACE
+cc -shared -fPIC examples/linux/malloc_shim.c -I"./" -o build/liballocators_malloc_profile.so -O2 -pthread -DALLOCATORS_PROFILE
+cc examples/linux/trace_replay.c -I"./" -o build/trace_replay -O2
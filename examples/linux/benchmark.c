@@ -0,0 +1,384 @@
+// Timing-only benchmark: every workload runs with every allocator in its own forked process, so peak RSS and page faults belong to that run only.
+// Time is measured for batches of BENCH_BATCH_SIZE allocator calls, percentiles are taken over ns/op of these batches.
+// Usage: benchmark [workload...], without arguments all workloads are run
+#define ALLOCATORS_IMPLEMENTATION
+#define ALLOCATORS_THREAD_SAFE
+#define ALLOCATORS_PLATFORM_LINUX
+#include "allocators.h"
+#include "time.h"
+#include "pthread.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/resource.h"
+#include "sys/wait.h"
+
+#ifndef BENCH_BATCH_SIZE
+#define BENCH_BATCH_SIZE 64
+#endif
+#ifndef BENCH_THREAD_COUNT
+#define BENCH_THREAD_COUNT 4
+#endif
+#define BENCH_MAX_SAMPLES (1 << 22)
+
+typedef struct Allocator Allocator;
+struct Allocator {
+    const char *name;
+    bool thread_safe;
+    void *(*allocate)(int64_t size);
+    void *(*realloc)(void *memory, int64_t new_size);
+    void  (*free)(void *memory);
+};
+
+static HeapArena bench_arena;
+
+static void *ArenaAllocate(int64_t size)                 { return HeapArenaAllocate(&bench_arena, size); }
+static void *ArenaRealloc(void *memory, int64_t size)    { return HeapArenaRealloc(&bench_arena, memory, size); }
+static void  ArenaFree(void *memory)                     { HeapArenaFree(&bench_arena, memory); }
+static void *SystemAllocate(int64_t size)                { return malloc(size); }
+static void *SystemRealloc(void *memory, int64_t size)   { return realloc(memory, size); }
+static void  SystemFree(void *memory)                    { free(memory); }
+
+static Allocator allocators[] = {
+    {"malloc",      true,  SystemAllocate,     SystemRealloc,     SystemFree},
+    {"heap arena",  false, ArenaAllocate,      ArenaRealloc,      ArenaFree},
+    {"thread heap", true,  ThreadHeapAllocate, ThreadHeapRealloc, ThreadHeapFree},
+};
+
+// Samples live outside of the measured allocators
+typedef struct Samples Samples;
+struct Samples {
+    double *values; // ns/op of every batch
+    int64_t count;
+    int64_t calls;
+    int64_t total_ns;
+};
+
+static void *BenchMap(int64_t size) {
+    void *memory = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    assert(memory != MAP_FAILED);
+    return memory;
+}
+
+static inline int64_t Now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ll + time.tv_nsec;
+}
+
+static inline void SamplesAdd(Samples *samples, int64_t begin, int64_t calls) {
+    int64_t elapsed = Now() - begin;
+    samples->calls    += calls;
+    samples->total_ns += elapsed;
+    if (samples->count < BENCH_MAX_SAMPLES) {
+        samples->values[samples->count++] = (double)elapsed / calls;
+    }
+}
+
+static inline uint64_t Random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// log-uniform size in [min_size, max_size], small sizes dominate as in real programs
+static inline int64_t RandomSize(uint64_t *state, int64_t min_size, int64_t max_size) {
+    int64_t bits = 63 - __builtin_clzll(max_size / min_size);
+    int64_t size = min_size << (Random(state) % (bits + 1));
+    return size + Random(state) % size;
+}
+
+static inline void Touch(void *memory, int64_t size) {
+    *(volatile uint8_t*)memory = 1;
+    *((volatile uint8_t*)memory + size - 1) = 1;
+}
+
+// Workloads
+
+#define CHURN_SLOTS 10000
+#define CHURN_STEPS 4000000
+
+static void BenchChurn(Allocator *allocator, Samples *samples) {
+    void **slots = BenchMap(CHURN_SLOTS * sizeof(void*));
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (int64_t step = 0; step < CHURN_STEPS; step += BENCH_BATCH_SIZE / 2) {
+        int64_t begin = Now();
+        for (int64_t i = 0; i < BENCH_BATCH_SIZE / 2; ++i) {
+            int64_t slot = Random(&state) % CHURN_SLOTS;
+            int64_t size = RandomSize(&state, 8, 4096);
+            if (slots[slot]) {
+                allocator->free(slots[slot]);
+            }
+            slots[slot] = allocator->allocate(size);
+            Touch(slots[slot], size);
+        }
+        SamplesAdd(samples, begin, BENCH_BATCH_SIZE);
+    }
+    for (int64_t i = 0; i < CHURN_SLOTS; ++i) {
+        if (slots[i]) {
+            allocator->free(slots[i]);
+        }
+    }
+}
+
+#define LIFETIME_OBJECTS 16384
+#define LIFETIME_ROUNDS  100
+
+static void BenchLifetime(Allocator *allocator, Samples *samples, bool fifo) {
+    void **objects = BenchMap(LIFETIME_OBJECTS * sizeof(void*));
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    for (int64_t round = 0; round < LIFETIME_ROUNDS; ++round) {
+        for (int64_t i = 0; i < LIFETIME_OBJECTS; i += BENCH_BATCH_SIZE) {
+            int64_t begin = Now();
+            for (int64_t j = i; j < i + BENCH_BATCH_SIZE; ++j) {
+                int64_t size = RandomSize(&state, 16, 512);
+                objects[j] = allocator->allocate(size);
+                Touch(objects[j], size);
+            }
+            SamplesAdd(samples, begin, BENCH_BATCH_SIZE);
+        }
+        for (int64_t i = 0; i < LIFETIME_OBJECTS; i += BENCH_BATCH_SIZE) {
+            int64_t begin = Now();
+            for (int64_t j = i; j < i + BENCH_BATCH_SIZE; ++j) {
+                allocator->free(objects[fifo ? j : LIFETIME_OBJECTS - 1 - j]);
+            }
+            SamplesAdd(samples, begin, BENCH_BATCH_SIZE);
+        }
+    }
+}
+
+static void BenchFifo(Allocator *allocator, Samples *samples) {
+    BenchLifetime(allocator, samples, true);
+}
+
+static void BenchLifo(Allocator *allocator, Samples *samples) {
+    BenchLifetime(allocator, samples, false);
+}
+
+// Several buffers grow at the same time, like vectors/strings being built side by side, so they get in the way of each other
+#define REALLOC_BUFFERS  8
+#define REALLOC_MAX_SIZE (1 << 20)
+#define REALLOC_ROUNDS   200
+
+static void BenchRealloc(Allocator *allocator, Samples *samples) {
+    void *buffers[REALLOC_BUFFERS];
+    for (int64_t round = 0; round < REALLOC_ROUNDS; ++round) {
+        int64_t begin = Now();
+        for (int64_t i = 0; i < REALLOC_BUFFERS; ++i) {
+            buffers[i] = allocator->allocate(16);
+        }
+        SamplesAdd(samples, begin, REALLOC_BUFFERS);
+
+        for (int64_t size = 16; size < REALLOC_MAX_SIZE; ) {
+            size += size / 2;
+            begin = Now();
+            for (int64_t i = 0; i < REALLOC_BUFFERS; ++i) {
+                buffers[i] = allocator->realloc(buffers[i], size);
+                Touch(buffers[i], size);
+            }
+            SamplesAdd(samples, begin, REALLOC_BUFFERS);
+        }
+
+        begin = Now();
+        for (int64_t i = 0; i < REALLOC_BUFFERS; ++i) {
+            allocator->free(buffers[i]);
+        }
+        SamplesAdd(samples, begin, REALLOC_BUFFERS);
+    }
+}
+
+// Every size class of the slabs and then powers of two up to the large allocations
+#define SWEEP_OBJECTS 256
+#define SWEEP_ROUNDS  40
+
+static void BenchSweep(Allocator *allocator, Samples *samples) {
+    void *objects[SWEEP_OBJECTS];
+    for (int64_t round = 0; round < SWEEP_ROUNDS; ++round) {
+        for (int64_t size = 8; size <= 1024*1024; size = size < 1024 ? size + 8 : size * 2) {
+            for (int64_t i = 0; i < SWEEP_OBJECTS; i += BENCH_BATCH_SIZE) {
+                int64_t begin = Now();
+                for (int64_t j = i; j < i + BENCH_BATCH_SIZE; ++j) {
+                    objects[j] = allocator->allocate(size);
+                    Touch(objects[j], size);
+                }
+                SamplesAdd(samples, begin, BENCH_BATCH_SIZE);
+            }
+            for (int64_t i = 0; i < SWEEP_OBJECTS; i += BENCH_BATCH_SIZE) {
+                int64_t begin = Now();
+                for (int64_t j = i; j < i + BENCH_BATCH_SIZE; ++j) {
+                    allocator->free(objects[j]);
+                }
+                SamplesAdd(samples, begin, BENCH_BATCH_SIZE);
+            }
+        }
+    }
+}
+
+// Larson-style: threads replace random objects in their slots, after every round slots are passed to the next thread,
+// so most of the memory is freed by a thread that didn't allocate it
+#define LARSON_SLOTS  2000
+#define LARSON_STEPS  20000
+#define LARSON_ROUNDS 50
+
+typedef struct LarsonThread LarsonThread;
+struct LarsonThread {
+    Allocator *allocator;
+    Samples samples;
+    int64_t index;
+};
+
+static void **larson_slots[BENCH_THREAD_COUNT];
+static pthread_barrier_t larson_barrier;
+
+static void *LarsonThreadMain(void *parameter) {
+    LarsonThread *thread = parameter;
+    Allocator *allocator = thread->allocator;
+    uint64_t state = 0x9E3779B97F4A7C15ull * (thread->index + 1);
+    for (int64_t round = 0; round < LARSON_ROUNDS; ++round) {
+        void **slots = larson_slots[(thread->index + round) % BENCH_THREAD_COUNT];
+        for (int64_t step = 0; step < LARSON_STEPS; step += BENCH_BATCH_SIZE / 2) {
+            int64_t begin = Now();
+            for (int64_t i = 0; i < BENCH_BATCH_SIZE / 2; ++i) {
+                int64_t slot = Random(&state) % LARSON_SLOTS;
+                int64_t size = RandomSize(&state, 8, 1024);
+                if (slots[slot]) {
+                    allocator->free(slots[slot]);
+                }
+                slots[slot] = allocator->allocate(size);
+                Touch(slots[slot], size);
+            }
+            SamplesAdd(&thread->samples, begin, BENCH_BATCH_SIZE);
+        }
+        pthread_barrier_wait(&larson_barrier);
+    }
+    return 0;
+}
+
+static void BenchLarson(Allocator *allocator, Samples *samples) {
+    pthread_t handles[BENCH_THREAD_COUNT];
+    LarsonThread threads[BENCH_THREAD_COUNT];
+    pthread_barrier_init(&larson_barrier, 0, BENCH_THREAD_COUNT);
+    for (int64_t i = 0; i < BENCH_THREAD_COUNT; ++i) {
+        larson_slots[i] = BenchMap(LARSON_SLOTS * sizeof(void*));
+        threads[i] = (LarsonThread){.allocator = allocator, .samples = {.values = BenchMap(BENCH_MAX_SAMPLES * sizeof(double))}, .index = i};
+    }
+    for (int64_t i = 0; i < BENCH_THREAD_COUNT; ++i) {
+        pthread_create(&handles[i], 0, LarsonThreadMain, &threads[i]);
+    }
+    for (int64_t i = 0; i < BENCH_THREAD_COUNT; ++i) {
+        pthread_join(handles[i], 0);
+    }
+
+    // note: total time is the sum over threads, so ns/op is the cost of a call as seen by one thread
+    for (int64_t i = 0; i < BENCH_THREAD_COUNT; ++i) {
+        Samples *thread_samples = &threads[i].samples;
+        int64_t count = thread_samples->count;
+        if (count > BENCH_MAX_SAMPLES - samples->count) {
+            count = BENCH_MAX_SAMPLES - samples->count;
+        }
+        memcpy(samples->values + samples->count, thread_samples->values, count * sizeof(double));
+        samples->count    += count;
+        samples->calls    += thread_samples->calls;
+        samples->total_ns += thread_samples->total_ns;
+    }
+}
+
+typedef struct Workload Workload;
+struct Workload {
+    const char *name;
+    bool threaded;
+    void (*run)(Allocator *allocator, Samples *samples);
+};
+
+static Workload workloads[] = {
+    {"churn",   false, BenchChurn},
+    {"fifo",    false, BenchFifo},
+    {"lifo",    false, BenchLifo},
+    {"realloc", false, BenchRealloc},
+    {"sweep",   false, BenchSweep},
+    {"larson",  true,  BenchLarson},
+};
+
+// Reporting
+
+typedef struct Result Result;
+struct Result {
+    int64_t calls;
+    double mean;
+    double percentiles[5];
+};
+
+static const double percentile_points[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void RunChild(Workload *workload, Allocator *allocator, Result *result) {
+    Samples samples = {.values = BenchMap(BENCH_MAX_SAMPLES * sizeof(double))};
+    workload->run(allocator, &samples);
+
+    qsort(samples.values, samples.count, sizeof(double), CompareDoubles);
+    result->calls = samples.calls;
+    result->mean  = (double)samples.total_ns / samples.calls;
+    for (int64_t i = 0; i < 5; ++i) {
+        int64_t index = (int64_t)(percentile_points[i] * (samples.count - 1));
+        result->percentiles[i] = samples.values[index];
+    }
+}
+
+static bool IsSelected(const char *name, int argc, char **argv) {
+    if (argc < 2) {
+        return true;
+    }
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    Result *result = mmap(0, sizeof(Result), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    assert(result != MAP_FAILED);
+
+    printf("%-8s %-12s %10s %8s %8s %8s %8s %8s %10s %12s %12s\n",
+           "workload", "allocator", "calls", "ns/op", "p50", "p90", "p99", "p99.9", "max", "peak RSS KB", "page faults");
+    for (int64_t i = 0; i < (int64_t)(sizeof(workloads) / sizeof(workloads[0])); ++i) {
+        Workload *workload = &workloads[i];
+        if (!IsSelected(workload->name, argc, argv)) {
+            continue;
+        }
+        for (int64_t j = 0; j < (int64_t)(sizeof(allocators) / sizeof(allocators[0])); ++j) {
+            Allocator *allocator = &allocators[j];
+            if (workload->threaded && !allocator->thread_safe) {
+                continue;
+            }
+
+            memset(result, 0, sizeof(Result));
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == 0) {
+                RunChild(workload, allocator, result);
+                _exit(0);
+            }
+            int status = 0;
+            struct rusage usage = {0};
+            wait4(child, &status, 0, &usage);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("%-8s %-12s failed\n", workload->name, allocator->name);
+                continue;
+            }
+
+            printf("%-8s %-12s %10lld %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f %12ld %12ld\n",
+                   workload->name, allocator->name, (long long)result->calls, result->mean,
+                   result->percentiles[0], result->percentiles[1], result->percentiles[2], result->percentiles[3], result->percentiles[4],
+                   usage.ru_maxrss, usage.ru_minflt + usage.ru_majflt);
+        }
+    }
+}
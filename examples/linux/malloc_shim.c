@@ -0,0 +1,231 @@
+// Drop-in replacement of the libc allocator, build it as a shared library (see build_examples.sh) and preload it:
+//     LD_PRELOAD=./build/liballocators_malloc.so <program>
+// Every thread allocates from its own ThreadHeap. Nothing has to be initialized before the first call: heaps, their registry and
+// the page map are static or come straight from mmap, so malloc works even when it is called by the dynamic loader or libc startup code.
+// Built with ALLOCATORS_TRACE, it records a trace to the file named by ALLOCATORS_TRACE_FILE environment variable.
+// Built with ALLOCATORS_PROFILE, it samples allocations and dumps the heap profile to ALLOCATORS_PROFILE_FILE when the program exits,
+// ALLOCATORS_PROFILE_RATE sets the average count of bytes between samples
+#define ALLOCATORS_IMPLEMENTATION
+#define ALLOCATORS_THREAD_SAFE
+#define ALLOCATORS_PLATFORM_LINUX
+#include "allocators.h"
+#include "errno.h"
+#include "pthread.h"
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+// Heap of the exited thread is handed back to the registry by the key destructor, the key is created on the first allocation
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shim_thread_key;
+static ALLOCATORS_THREAD_LOCAL bool shim_thread_registered;
+
+static void ShimThreadExit(void *value) {
+    (void)value;
+    shim_thread_registered = false;
+    ThreadHeapRelease();
+}
+
+// note: all locks are taken around fork, so the child doesn't inherit them locked by a thread that doesn't exist there
+static void ShimForkPrepare(void) {
+#ifdef ALLOCATORS_TRACE
+    HeapTraceLock();
+#endif
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileLock();
+#endif
+    HeapRegistryLock();
+    while (!AtomicCompareExchange32(&heap_page_map_lock, 0, 1)) {
+    }
+}
+
+static void ShimForkFinish(void) {
+    AtomicStore32(&heap_page_map_lock, 0);
+    HeapRegistryUnlock();
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileUnlock();
+#endif
+#ifdef ALLOCATORS_TRACE
+    HeapTraceUnlock();
+#endif
+}
+
+// note: only the parent keeps tracing and profiling, records buffered before the fork belong to it
+static void ShimForkChild(void) {
+    ShimForkFinish();
+#ifdef ALLOCATORS_TRACE
+    heap_trace.buffered = 0;
+    HeapTraceStop();
+#endif
+#ifdef ALLOCATORS_PROFILE
+    HeapProfileStop();
+#endif
+}
+
+static void ShimInit(void) {
+    pthread_key_create(&shim_thread_key, ShimThreadExit);
+    pthread_atfork(ShimForkPrepare, ShimForkFinish, ShimForkChild);
+}
+
+static inline void ShimRegisterThread(void) {
+    if (shim_thread_registered) {
+        return;
+    }
+    shim_thread_registered = true;
+    pthread_once(&shim_once, ShimInit);
+    // note: key is created early, so it is stored inside the thread descriptor and setspecific doesn't allocate
+    pthread_setspecific(shim_thread_key, (void*)1);
+}
+
+#ifdef ALLOCATORS_TRACE
+__attribute__((constructor)) static void ShimTraceStart(void) {
+    const char *path = getenv("ALLOCATORS_TRACE_FILE");
+    if (path) {
+        ShimRegisterThread();
+        HeapTraceStart(path);
+    }
+}
+
+__attribute__((destructor)) static void ShimTraceStop(void) {
+    HeapTraceStop();
+}
+#endif
+
+#ifdef ALLOCATORS_PROFILE
+__attribute__((constructor)) static void ShimProfileStart(void) {
+    const char *rate = getenv("ALLOCATORS_PROFILE_RATE");
+    if (getenv("ALLOCATORS_PROFILE_FILE")) {
+        ShimRegisterThread();
+        HeapProfileStart(rate ? atoll(rate) : 0);
+    }
+}
+
+__attribute__((destructor)) static void ShimProfileStop(void) {
+    const char *path = getenv("ALLOCATORS_PROFILE_FILE");
+    if (path) {
+        HeapProfileDump(path);
+        HeapProfileStop();
+    }
+}
+#endif
+
+static inline void *ShimAllocate(size_t size) {
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    ShimRegisterThread();
+    void *memory = ThreadHeapAllocate(size);
+    if (!memory) {
+        errno = ENOMEM;
+    }
+    return memory;
+}
+
+static inline void *ShimAllocateAligned(size_t size, size_t alignment) {
+    if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    ShimRegisterThread();
+    void *memory = 0;
+    if (alignment <= ALLOCATION_GRANULARITY) {
+        memory = ThreadHeapAllocate(size);
+    } else {
+        memory = ThreadHeapAllocateAligned(size, alignment);
+    }
+    if (!memory) {
+        errno = ENOMEM;
+    }
+    return memory;
+}
+
+static inline bool ShimIsPowerOfTwo(size_t value) {
+    return value && !(value & (value - 1));
+}
+
+SHIM_EXPORT void *malloc(size_t size) {
+    return ShimAllocate(size);
+}
+
+SHIM_EXPORT void free(void *memory) {
+    if (!memory) {
+        return;
+    }
+    ThreadHeapFree(memory);
+}
+
+SHIM_EXPORT void *calloc(size_t count, size_t size) {
+    size_t total_size = 0;
+    if (__builtin_mul_overflow(count, size, &total_size)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    void *memory = ShimAllocate(total_size);
+    if (memory) {
+        HeapArenaZeroMemory(memory, total_size);
+    }
+    return memory;
+}
+
+// note: same as glibc, realloc to zero size frees the memory and returns null
+SHIM_EXPORT void *realloc(void *memory, size_t new_size) {
+    if (!memory) {
+        return ShimAllocate(new_size);
+    }
+    if (!new_size) {
+        ThreadHeapFree(memory);
+        return 0;
+    }
+    if (new_size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return 0;
+    }
+    ShimRegisterThread();
+    // note: same as realloc, memory stays with the caller if it can't be moved
+    void *new_memory = ThreadHeapRealloc(memory, new_size);
+    if (!new_memory) {
+        errno = ENOMEM;
+    }
+    return new_memory;
+}
+
+SHIM_EXPORT int posix_memalign(void **result, size_t alignment, size_t size) {
+    if (!ShimIsPowerOfTwo(alignment) || alignment % sizeof(void*)) {
+        return EINVAL;
+    }
+    void *memory = ShimAllocateAligned(size, alignment);
+    if (!memory) {
+        return ENOMEM;
+    }
+    *result = memory;
+    return 0;
+}
+
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    if (!ShimIsPowerOfTwo(alignment)) {
+        errno = EINVAL;
+        return 0;
+    }
+    return ShimAllocateAligned(size, alignment);
+}
+
+// glibc routes these through the same allocator, so they have to be replaced as well, otherwise their memory would reach our free
+SHIM_EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+SHIM_EXPORT void *valloc(size_t size) {
+    return ShimAllocateAligned(size, HEAP_ARENA_PAGE_SIZE);
+}
+
+SHIM_EXPORT void *pvalloc(size_t size) {
+    size = (size + HEAP_ARENA_PAGE_SIZE - 1) & ~(size_t)(HEAP_ARENA_PAGE_SIZE - 1);
+    return ShimAllocateAligned(size, HEAP_ARENA_PAGE_SIZE);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *memory) {
+    if (!memory) {
+        return 0;
+    }
+    return HeapArenaUsableSize(memory);
+}
@@ -0,0 +1,171 @@
+// Replays a trace recorded with ALLOCATORS_TRACE (e.g. by the malloc shim) against the heap arena or the system allocator.
+// Records are replayed in the order they were written by one thread, so every run makes exactly the same calls.
+// Usage: trace_replay <trace file> [heap|malloc] [timeline interval in records]
+// With the interval given, live bytes, RSS and arena footprint are printed every that many records, so fragmentation can be followed over time
+#define ALLOCATORS_IMPLEMENTATION
+#define ALLOCATORS_PLATFORM_LINUX
+#include "allocators.h"
+#include "time.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/resource.h"
+
+static HeapArena replay_arena;
+static bool replay_system;
+
+static inline int64_t Now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ll + time.tv_nsec;
+}
+
+static int64_t GetRSS(void) {
+    int64_t pages = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%lld %lld", (long long*)&pages, (long long*)&resident) != 2) {
+            resident = 0;
+        }
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void *ReplayAllocate(HeapTraceRecord *record) {
+    int64_t alignment = (int64_t)1 << record->alignment_log2;
+    if (replay_system) {
+        if (record->alignment_log2) {
+            void *memory = 0;
+            if (posix_memalign(&memory, alignment < (int64_t)sizeof(void*) ? (int64_t)sizeof(void*) : alignment, record->size) != 0) {
+                return 0;
+            }
+            return memory;
+        }
+        if (record->op == HEAP_TRACE_ALLOCATE_ZEROED) {
+            return calloc(1, record->size);
+        }
+        return malloc(record->size);
+    }
+
+    if (record->alignment_log2) {
+        return HeapArenaAllocateAligned(&replay_arena, record->size, alignment);
+    }
+    if (record->op == HEAP_TRACE_ALLOCATE_ZEROED) {
+        return HeapArenaAllocateZeroed(&replay_arena, record->size);
+    }
+    return HeapArenaAllocate(&replay_arena, record->size);
+}
+
+static void *ReplayRealloc(void *memory, int64_t size) {
+    if (replay_system) {
+        // note: the arena keeps memory reallocated to zero size, glibc frees it
+        return realloc(memory, size ? size : 1);
+    }
+    return HeapArenaRealloc(&replay_arena, memory, size);
+}
+
+static void ReplayFree(void *memory) {
+    if (replay_system) {
+        free(memory);
+    } else {
+        HeapArenaFree(&replay_arena, memory);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [heap|malloc] [timeline interval in records]\n", argv[0]);
+        return 1;
+    }
+    replay_system = argc > 2 && strcmp(argv[2], "malloc") == 0;
+    int64_t interval = argc > 3 ? atoll(argv[3]) : 0;
+
+    // note: trace is mapped, so it doesn't take memory from the allocator being measured
+    int descriptor = open(argv[1], O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0 || status.st_size < 2 * (int64_t)sizeof(uint32_t)) {
+        printf("Can't read the trace '%s'\n", argv[1]);
+        return 1;
+    }
+    uint32_t *header = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    assert(header != MAP_FAILED);
+    if (header[0] != HEAP_TRACE_MAGIC || header[1] != HEAP_TRACE_VERSION) {
+        printf("'%s' is not a trace of version %d\n", argv[1], HEAP_TRACE_VERSION);
+        return 1;
+    }
+    HeapTraceRecord *records = (HeapTraceRecord*)(header + 2);
+    int64_t record_count = (status.st_size - 2 * sizeof(uint32_t)) / sizeof(HeapTraceRecord);
+
+    uint32_t object_count = 0;
+    for (int64_t i = 0; i < record_count; ++i) {
+        if (records[i].object >= object_count) {
+            object_count = records[i].object + 1;
+        }
+    }
+    void **objects = mmap(0, (object_count + 1) * sizeof(void*), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    int64_t *sizes = mmap(0, (object_count + 1) * sizeof(int64_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    assert(objects != MAP_FAILED && sizes != MAP_FAILED);
+
+    if (interval) {
+        printf("%12s %12s %14s %14s %14s %14s\n", "record", "trace ms", "live bytes", "RSS bytes", "arena bytes", "RSS/live");
+    }
+
+    int64_t live_size = 0, peak_live_size = 0;
+    int64_t elapsed = 0;
+    int64_t begin = Now();
+    for (int64_t i = 0; i < record_count; ++i) {
+        HeapTraceRecord *record = &records[i];
+        void **object = &objects[record->object];
+        switch (record->op) {
+            case HEAP_TRACE_ALLOCATE:
+            case HEAP_TRACE_ALLOCATE_ZEROED: {
+                if (*object) {
+                    break;
+                }
+                *object = ReplayAllocate(record);
+                assert(*object && "Replayed allocation failed");
+                *(volatile uint8_t*)*object = 1;
+                sizes[record->object] = record->size;
+                live_size += record->size;
+            } break;
+            case HEAP_TRACE_REALLOC: {
+                *object = *object ? ReplayRealloc(*object, record->size) : ReplayAllocate(record);
+                assert(*object && "Replayed allocation failed");
+                *(volatile uint8_t*)*object = 1;
+                live_size += record->size - sizes[record->object];
+                sizes[record->object] = record->size;
+            } break;
+            case HEAP_TRACE_FREE: {
+                if (!*object) {
+                    break;
+                }
+                ReplayFree(*object);
+                *object = 0;
+                live_size -= sizes[record->object];
+                sizes[record->object] = 0;
+            } break;
+        }
+        if (live_size > peak_live_size) {
+            peak_live_size = live_size;
+        }
+
+        if (interval && (i + 1) % interval == 0) {
+            elapsed += Now() - begin;
+            int64_t rss = GetRSS();
+            int64_t arena_size = replay_system ? 0 : replay_arena.allocated_size;
+            printf("%12lld %12.1f %14lld %14lld %14lld %14.3f\n", (long long)(i + 1), record->time / 1000000.0,
+                   (long long)live_size, (long long)rss, (long long)arena_size, live_size ? (double)rss / live_size : 0.0);
+            begin = Now();
+        }
+    }
+    elapsed += Now() - begin;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Allocator: %s\n", replay_system ? "malloc" : "heap arena");
+    printf("Records: %lld, objects: %u\n", (long long)record_count, object_count);
+    printf("Time: %.3f ms, %.1f ns/op\n", elapsed / 1000000.0, record_count ? (double)elapsed / record_count : 0.0);
+    printf("Peak live bytes: %lld, peak RSS: %ld KB, page faults: %ld\n", (long long)peak_live_size, usage.ru_maxrss, usage.ru_minflt + usage.ru_majflt);
+}
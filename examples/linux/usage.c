@@ -0,0 +1,25 @@
+#define ALLOCATORS_IMPLEMENTATION
+#define ALLOCATORS_PLATFORM_LINUX
+#define ALLOCATORS_HUGE_PAGES
+#include "allocators.h"
+
+int main() {
+    char *hello_world = "Hello, world!";
+    int64_t string_size = strlen(hello_world) + 1;
+
+    HeapArena arena = {0};
+    char *memory = HeapArenaAllocate(&arena, string_size);
+    memcpy(memory, hello_world, string_size);
+    printf("%s\n", memory);
+
+    // large allocations get their own mapping, with ALLOCATORS_HUGE_PAGES it is backed by huge pages
+    int64_t buffer_size = 8*1024*1024;
+    char *buffer = HeapArenaAllocate(&arena, buffer_size);
+    memset(buffer, 0xAB, buffer_size);
+    buffer = HeapArenaRealloc(&arena, buffer, 2*buffer_size);
+    assert(buffer[buffer_size - 1] == (char)0xAB);
+
+    HeapArenaFree(&arena, buffer);
+    HeapArenaFree(&arena, memory);
+    HeapArenaRelease(&arena);
+}
@@ -5,26 +5,65 @@
 #define ALLOCATION_COUNT       10000
 #define CHANCE_TO_REALLOCATE     25
 #define CHANCE_TO_DEALLOCATE     25
+#define CHANCE_TO_ALIGN          10
+#define CHANCE_TO_TRIM           1
+#define CHANCE_TO_BATCH          2
+#define MAX_BATCH_COUNT          64
+#define MAX_ALIGNMENT_LOG2       12
 
 #include "stdlib.h"
 #include "assert.h"
 #include "stdio.h"
 #include "time.h"
 
+#if defined(ALLOCATORS_DEBUG) || defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+// errors are counted instead of aborting the test, see TestDebugChecks
+int64_t debug_report_count = 0;
+void CountDebugReport(const char *message, void *memory) {
+    debug_report_count += 1;
+}
+#define HEAP_DEBUG_REPORT CountDebugReport
+#endif
+
 #define ALLOCATORS_IMPLEMENTATION
 #include "allocators.h"
 
 #include "windows.h"
+// set by TestOutOfMemory, the platform has no memory to give while it is true
+bool platform_out_of_memory = false;
 void *PlatformGetMemory(int64_t size) {
+    if (platform_out_of_memory) {
+        return 0;
+    }
     void *memory = VirtualAlloc(0, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
     assert(memory);
     return memory; 
 }
 
-void PlatformFreeMemory(void *memory) {
+void PlatformFreeMemory(void *memory, int64_t size) {
     VirtualFree(memory, 0, MEM_RELEASE);
 }
 
+#if defined(ALLOCATORS_CONTIGUOUS_HEAP) || defined(ALLOCATORS_DEBUG_GUARD_PAGES)
+void *PlatformReserveMemory(int64_t size) {
+    if (platform_out_of_memory) {
+        return 0;
+    }
+    return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool PlatformCommitMemory(void *memory, int64_t size) {
+    if (platform_out_of_memory) {
+        return false;
+    }
+    return VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
+void PlatformDecommitMemory(void *memory, int64_t size) {
+    VirtualFree(memory, size, MEM_DECOMMIT);
+}
+#endif
+
 int64_t random_i64(int64_t min, int64_t max) {
     assert(min <= max);
     int64_t res = min + rand() % (max - min + 1);
@@ -79,6 +118,10 @@ bool TestNodeIntegrity(AllocationNode *node, int64_t black_nodes_count, int64_t
 
     if (node->left) {
         AllocationNode *left = node->left;
+        if (!RBT_NodeLess(left, node)) {
+            printf("Left child(%lld, %p) isn't ordered before its parent(%lld, %p)\n", left->size, left, node->size, node);
+            return false;
+        }
         if (left->parent != node) {
             if (!left->parent) {
                 printf("Invalid node(%lld) parent(null)\n", left->size);
@@ -99,6 +142,10 @@ bool TestNodeIntegrity(AllocationNode *node, int64_t black_nodes_count, int64_t
     
     if (node->right) {
         AllocationNode *right = node->right;
+        if (!RBT_NodeLess(node, right)) {
+            printf("Right child(%lld, %p) isn't ordered after its parent(%lld, %p)\n", right->size, right, node->size, node);
+            return false;
+        }
         if (node->right->parent != node) {
             if (!right->parent) {
                 printf("Invalid node(%lld) parent(null)\n", right->size);
@@ -130,55 +177,146 @@ void TestRBTIntegrity(AllocationNode *root) {
     assert(res && "Red-Black tree integrity test failed");
 }
 
-void TestAllocatorIntegrity(HeapArena *arena, int64_t allocated_size) {
-    int64_t remaining_size = allocated_size;
+#ifdef ALLOCATORS_TLSF
+void TestTLSFIntegrity(HeapArena *arena) {
+    int64_t free_chunk_count = 0;
+    for (int64_t first=0;first<HEAP_TLSF_FIRST_LEVEL_COUNT;++first) {
+        bool first_is_empty = true;
+        for (int64_t second=0;second<HEAP_TLSF_SECOND_LEVEL_COUNT;++second) {
+            AllocationNode *list = arena->free_lists[first][second];
+            bool bit_is_set = (arena->free_second_level[first] >> second) & 1;
+            assert(bit_is_set == (list != 0) && "Second level bitmap doesn't match the lists");
+            first_is_empty = first_is_empty && !list;
+
+            for (AllocationNode *node=list;node;node=node->next) {
+                int64_t node_first = 0, node_second = 0;
+                HeapTLSFMapping(AllocationNodeSize(node), &node_first, &node_second);
+                assert(node_first == first && node_second == second && "Free chunk is in the wrong class");
+                assert(!AllocationNodeOccupied(node) && "Occupied chunk is in the free list");
+                assert((!node->next || node->next->previous == node) && "Invalid free list links");
+                free_chunk_count += 1;
+            }
+        }
+        bool bit_is_set = (arena->free_first_level >> first) & 1;
+        assert(bit_is_set == !first_is_empty && "First level bitmap doesn't match the lists");
+    }
+    assert(free_chunk_count == arena->free_chunk_count && "Free lists don't hold every free chunk");
+}
+#endif
 
-    // memory blocks
-    AllocationNode *previos_node = 0;
-    AllocationNode *node         = 0;
-    MemoryBlock *block = arena->first_block;
-    AllocationNode *ll_node = arena->first_node;
-    bool have_seen_first_node = false;
+void TestFreeIndexIntegrity(HeapArena *arena) {
+#ifdef ALLOCATORS_TLSF
+    TestTLSFIntegrity(arena);
+#else
+    TestRBTIntegrity(arena->root);
+#endif
+}
+
+void TestAllocatorIntegrity(HeapArena *arena) {
+    HeapArenaValidation validation = HeapArenaValidate(arena);
+    if (validation.error) {
+        printf("Validation failed: %s (%p)\n", validation.error, validation.memory);
+        fflush(stdout);
+    }
+    assert(!validation.error && validation.finished && "Arena validation failed");
+
+    int64_t allocated_size = 0;
+    int64_t free_size      = 0;
+    int64_t block_count      = 0;
+    int64_t large_count      = 0;
+    int64_t free_chunk_count = 0;
+    int64_t largest_free_chunk = 0;
+    int64_t free_histogram[HEAP_STATS_BUCKET_COUNT] = {0};
 
     // note: this loop may segfault, but then we know that allocator is definetely corrupted
+    MemoryBlock *block = arena->first_block;
     while(block) {
-        node = SkipMemoryBlockHeader(block); 
-        if (!have_seen_first_node) {
-            have_seen_first_node = true;
-            assert(node == arena->first_node && "Invalid first node");
-        }
+        allocated_size += sizeof(MemoryBlock);
+        block_count += 1;
+
+        AllocationNode *node = SkipMemoryBlockHeader(block); 
+        assert(node->previous_size == 0 && "Invalid first node");
 
+        bool previous_is_free = false;
         while(true) {
-            assert(ll_node == node && "Linked list node and in-memory node differ");
-            if (node->occupied) {
-                remaining_size -= node->used_size;
-            }
-            if (!node->next_in_order || node->next_in_order->memory_block != block) {
+            allocated_size += ALLOCATION_NODE_HEADER_SIZE + AllocationNodeSize(node);
+            if (!AllocationNodeSize(node)) {
+                assert(AllocationNodeOccupied(node) && "Memory block isn't terminated");
                 break;
             }
-            
-            AllocationNode *next = node->next_in_order; 
-            assert(next->previous_in_order == node && "Invalid next_in_order");
 
-            uint8_t *next_ptr = (uint8_t*)SkipAllocationNode(node) + node->size;
-            node = (AllocationNode*)next_ptr;
-            ll_node = ll_node->next_in_order;
+            if (!AllocationNodeOccupied(node)) {
+                assert(!previous_is_free && "Adjacent free nodes are not coalesced");
+                free_size += node->size;
+                free_chunk_count += 1;
+                if (node->size > largest_free_chunk) {
+                    largest_free_chunk = node->size;
+                }
+                free_histogram[HeapStatsBucket(node->size)] += 1;
+            }
+            previous_is_free = !AllocationNodeOccupied(node);
+
+            AllocationNode *next = GetNextNode(node); 
+            assert(next->previous_size == AllocationNodeSize(node) && "Invalid previous_size");
+            assert(GetPreviousNode(next) == node && "Invalid previous node");
+            node = next;
         } 
 
         if (!block->next) {
             assert(block == arena->last_block && "Invalid last block");
-            assert(node  == arena->last_node  && "Invalid last node");
         }
 
         block = block->next;
     }
 
-    if (!have_seen_first_node) {
-        assert(arena->first_block == 0);
-        assert(arena->first_node  == 0);
+    if (!arena->first_block) {
+        assert(arena->last_block == 0);
+    }
+
+    HeapLargeAllocation *large = arena->large_allocations;
+    while(large) {
+        assert(!large->previous || large->previous->next == large);
+        allocated_size += large->mapped_size;
+        large_count += 1;
+        large = large->next;
     }
+#ifdef ALLOCATORS_DEBUG_GUARD_PAGES
+    for (HeapDebugGuarded *guarded=arena->guarded_allocations;guarded;guarded=guarded->next) {
+        assert(!guarded->previous || guarded->previous->next == guarded);
+        allocated_size += guarded->mapped_size;
+        large_count += 1;
+    }
+#endif
 
-    assert(remaining_size == 0 && "Invalid allocated size");
+#if HEAP_QUICK_LIST_DEPTH
+    int64_t quick_size = 0;
+    for (int64_t index=0;index<HEAP_QUICK_LIST_COUNT;++index) {
+        int64_t quick_count = 0;
+        for (AllocationNode *node=arena->quick_lists[index];node;node=node->next) {
+            assert(AllocationNodeOccupied(node) && "Cached chunk should stay occupied");
+            assert(HeapQuickListIndex(AllocationNodeSize(node)) == index && "Cached chunk is in the wrong list");
+            quick_size += AllocationNodeSize(node);
+            quick_count += 1;
+        }
+        assert(quick_count == arena->quick_counts[index] && quick_count <= HEAP_QUICK_LIST_DEPTH && "Invalid quick list count");
+    }
+    assert(quick_size == arena->quick_size && "Invalid quick list size");
+#endif
+
+    assert(allocated_size == arena->allocated_size && "Invalid allocated size");
+    assert(free_size == arena->free_size && "Invalid free size");
+
+    HeapArenaStats stats = HeapArenaGetStats(arena);
+    assert(stats.block_count == block_count && "Invalid block count");
+    assert(stats.large_count == large_count && "Invalid large allocation count");
+    assert(stats.free_chunk_count == free_chunk_count && "Invalid free chunk count");
+    assert(memcmp(stats.free_histogram, free_histogram, sizeof(free_histogram)) == 0 && "Invalid free chunk histogram");
+    assert(stats.largest_free_chunk <= stats.free_size);
+#ifdef ALLOCATORS_TLSF
+    assert(stats.largest_free_chunk >= largest_free_chunk && "Largest free chunk is above the reported class limit");
+#else
+    assert(stats.largest_free_chunk == largest_free_chunk && "Invalid largest free chunk");
+#endif
 }
 
 typedef struct Memory Memory;
@@ -187,6 +325,194 @@ struct Memory {
     int64_t size;
 };
 
+// statistics count memory as the arena sees it, in debug mode it is the core allocation that holds the user memory
+int64_t ArenaUsableSize(void *memory) {
+#ifdef ALLOCATORS_DEBUG
+    uint64_t word = ((uint64_t*)memory)[-1];
+    if (HeapDebugIsGuarded(memory)) {
+        return HeapDebugSize(word);
+    }
+    return HeapArenaUsableSizeCore((uint8_t*)memory - HeapDebugOffset(word));
+#else
+    return HeapArenaUsableSize(memory);
+#endif
+}
+
+void TestLiveStats(HeapArena *arena, Memory *memory_array, int64_t count) {
+    int64_t live_size = 0;
+    int64_t live_histogram[HEAP_STATS_BUCKET_COUNT] = {0};
+    for (int64_t i=0;i<count;++i) {
+        int64_t usable_size = ArenaUsableSize(memory_array[i].ptr);
+        live_size += usable_size;
+        live_histogram[HeapStatsBucket(usable_size)] += 1;
+    }
+
+    HeapArenaStats stats = HeapArenaGetStats(arena);
+    assert(stats.live_count == count && "Invalid live count");
+    assert(stats.live_size == live_size && "Invalid live size");
+    assert(memcmp(stats.live_histogram, live_histogram, sizeof(live_histogram)) == 0 && "Invalid live histogram");
+}
+
+// allocates a batch, checks that every allocation is usable, then frees it in two shuffled batches
+void TestBatch(HeapArena *arena, Memory *memory_array, int64_t count) {
+    void *batch[MAX_BATCH_COUNT];
+    int64_t batch_count = random_i64(1, MAX_BATCH_COUNT);
+    int64_t size = random_i64(0, MAX_AMOUNT_TO_ALLOCATE);
+
+    HeapArenaAllocateBatch(arena, size, batch_count, batch);
+    for (int64_t i=0;i<batch_count;++i) {
+        assert(((uintptr_t)batch[i] & (ALLOCATION_GRANULARITY - 1)) == 0 && "Memory is not aligned");
+        assert(HeapArenaUsableSize(batch[i]) >= size && "Batch allocation is too small");
+        memset(batch[i], (int)i, size);
+    }
+    TestAllocatorIntegrity(arena);
+    assert(HeapArenaGetStats(arena).live_count == count + batch_count && "Invalid live count");
+    for (int64_t i=0;i<batch_count;++i) {
+        for (int64_t j=0;j<size;++j) {
+            assert(((uint8_t*)batch[i])[j] == (uint8_t)i && "Batch allocations overlap");
+        }
+    }
+
+    for (int64_t i=batch_count-1;i>0;--i) {
+        int64_t j = random_i64(0, i);
+        void *swap = batch[i];
+        batch[i] = batch[j];
+        batch[j] = swap;
+    }
+    int64_t half = batch_count / 2;
+    HeapArenaFreeBatch(arena, batch, half);
+    TestAllocatorIntegrity(arena);
+    HeapArenaFreeBatch(arena, batch + half, batch_count - half);
+    TestAllocatorIntegrity(arena);
+    TestLiveStats(arena, memory_array, count);
+    TestFreeIndexIntegrity(arena);
+}
+
+// aligned memory of the large size gets its own mapping as well, so the platform can give it back
+void TestLargeAligned(HeapArena *arena) {
+    int64_t alignment = (int64_t)1 << random_i64(5, MAX_ALIGNMENT_LOG2);
+    int64_t size = HEAP_ARENA_LARGE_ALLOCATION_SIZE + random_i64(0, MAX_AMOUNT_TO_ALLOCATE);
+    int64_t large_count = HeapArenaGetStats(arena).large_count;
+
+    uint8_t *memory = HeapArenaAllocateAligned(arena, size, alignment);
+    assert(((uintptr_t)memory & (alignment - 1)) == 0 && "Large memory is not aligned");
+    assert(HeapArenaGetStats(arena).large_count == large_count + 1 && "Large aligned memory isn't mapped on its own");
+    assert(HeapArenaUsableSize(memory) >= size && "Large aligned allocation is too small");
+    memset(memory, 0xAB, size);
+    TestAllocatorIntegrity(arena);
+
+    memory = HeapArenaRealloc(arena, memory, size * 2);
+    for (int64_t i=0;i<size;++i) {
+        assert(memory[i] == 0xAB && "Large aligned memory isn't preserved by realloc");
+    }
+    HeapArenaFree(arena, memory);
+    assert(HeapArenaGetStats(arena).large_count == large_count && "Large aligned memory isn't unmapped");
+    TestAllocatorIntegrity(arena);
+}
+
+// allocations that need memory from the platform fail without touching the arena, realloc keeps the old memory
+void TestOutOfMemory(HeapArena *arena) {
+    int64_t size = HEAP_ARENA_LARGE_ALLOCATION_SIZE;
+    int64_t chunk_size = HEAP_SLAB_MAX_SIZE + ALLOCATION_GRANULARITY;
+    uint8_t *memory = HeapArenaAllocate(arena, chunk_size);
+    memset(memory, 0xAB, chunk_size);
+    HeapArenaStats stats = HeapArenaGetStats(arena);
+
+    platform_out_of_memory = true;
+    assert(!HeapArenaAllocate(arena, size) && "Large allocation doesn't fail without memory");
+    assert(!HeapArenaAllocateAligned(arena, size, (int64_t)1 << MAX_ALIGNMENT_LOG2) && "Large aligned allocation doesn't fail without memory");
+    assert(!HeapArenaRealloc(arena, memory, size) && "Realloc doesn't fail without memory");
+#ifndef ALLOCATORS_CONTIGUOUS_HEAP
+    // note: the largest chunk that isn't large needs a new block, unless some free chunk can hold it
+    if (stats.largest_free_chunk < size - ALLOCATION_GRANULARITY) {
+        assert(!HeapArenaAllocate(arena, size - ALLOCATION_GRANULARITY) && "New block is used without memory");
+    }
+#endif
+    platform_out_of_memory = false;
+
+    HeapArenaStats after = HeapArenaGetStats(arena);
+    assert(after.allocated_size == stats.allocated_size && after.live_size == stats.live_size && after.live_count == stats.live_count && "Failed allocation has changed the arena");
+    for (int64_t i=0;i<chunk_size;++i) {
+        assert(memory[i] == 0xAB && "Failed realloc has changed the memory");
+    }
+    HeapArenaFree(arena, memory);
+    TestAllocatorIntegrity(arena);
+}
+
+// incremental validation continues over the changes made between the steps, so it runs after every operation with a small budget
+void TestValidateStep(HeapArena *arena) {
+    HeapArenaValidation validation = HeapArenaValidateStep(arena, random_i64(1, 64));
+    if (validation.error) {
+        printf("Incremental validation failed: %s (%p)\n", validation.error, validation.memory);
+        fflush(stdout);
+    }
+    assert(!validation.error && "Incremental validation failed");
+}
+
+// broken boundary tag is reported by both validations, then it is repaired
+void TestValidateReports(HeapArena *arena) {
+    if (!arena->first_block) {
+        return;
+    }
+    AllocationNode *node = SkipMemoryBlockHeader(arena->first_block);
+    AllocationNode *next = GetNextNode(node);
+    next->previous_size += ALLOCATION_GRANULARITY;
+
+    HeapArenaValidation validation = HeapArenaValidate(arena);
+    assert(validation.error && validation.memory == node && "Broken boundary tag isn't reported");
+    // note: the pass that is in progress may have passed the chunk already, the next one reaches it
+    int64_t finished_passes = 0;
+    do {
+        assert(finished_passes < 2 && "Broken boundary tag isn't reported by the step");
+        validation = HeapArenaValidateStep(arena, 64);
+        finished_passes += validation.finished;
+    } while (!validation.error);
+    // note: a step that starts right after the chunk sees the same break from the side of the next chunk
+    assert((validation.memory == node || validation.memory == next) && "Broken boundary tag is reported at the wrong chunk");
+
+    next->previous_size -= ALLOCATION_GRANULARITY;
+    TestAllocatorIntegrity(arena);
+}
+
+#ifdef ALLOCATORS_DEBUG
+// every corruption is reported exactly once and the memory is left alone, so after the repair it can be freed as usual.
+// Freed memory is read back, so the size is kept below the large allocations and the neighbour keeps the slab or the block mapped
+void TestDebugChecks(HeapArena *arena) {
+    int64_t size = random_i64(0, 512);
+    void *neighbour = HeapArenaAllocate(arena, size);
+    uint8_t *memory = HeapArenaAllocate(arena, size);
+    int64_t reports = debug_report_count;
+
+    // note: memory smaller than a pointer is checked from the pointer size on, see HeapDebugTrailerOffset
+    int64_t trailer = HeapDebugTrailerOffset(size);
+    uint8_t saved = memory[trailer];
+    memory[trailer] = ~saved;
+    HeapArenaFree(arena, memory);
+    assert(debug_report_count == reports + 1 && "Overflow isn't reported");
+    memory[trailer] = saved;
+
+    saved = memory[-16];
+    memory[-16] = ~saved;
+    assert(HeapArenaRealloc(arena, memory, size) == 0 && debug_report_count == reports + 2 && "Underflow isn't reported");
+    memory[-16] = saved;
+
+    HeapArenaFree(arena, memory + ALLOCATION_GRANULARITY / 2);
+    assert(debug_report_count == reports + 3 && "Misaligned pointer isn't reported");
+
+    HeapArenaFree(arena, memory);
+    assert(debug_report_count == reports + 3 && "Valid free is reported");
+#ifndef ALLOCATORS_DEBUG_GUARD_PAGES
+    // note: the free index overwrites the first bytes of the freed chunk with its links, memory of the guarded allocation is unmapped
+    for (int64_t i=32;i<size && i<HEAP_DEBUG_POISON_SIZE;++i) {
+        assert(memory[i] == HEAP_DEBUG_FREED_BYTE && "Freed memory isn't poisoned");
+    }
+    HeapArenaFree(arena, memory);
+    assert(debug_report_count == reports + 4 && "Double free isn't reported");
+#endif
+    HeapArenaFree(arena, neighbour);
+}
+#endif
+
 void maybe_printf(char *format, ...) {
 #if PRINT_STEPS
     va_list args;
@@ -227,6 +553,11 @@ int main() {
     for (int64_t j=0;j<EPOCH_COUNT;++j) {
 #endif
     int64_t memory_index = 0;
+    TestLargeAligned(&arena);
+    TestOutOfMemory(&arena);
+#ifdef ALLOCATORS_DEBUG
+    TestDebugChecks(&arena);
+#endif
 
     clock_t our_clocks = 0;
     clock_t malloc_clocks = 0;
@@ -237,9 +568,16 @@ int main() {
 
         maybe_printf("Iteration(%lld), allocating %lld\n", i, to_allocate);
 
+        int64_t alignment = ALLOCATION_GRANULARITY;
+        if (random_i64(0, 100) < CHANCE_TO_ALIGN) {
+            alignment = (int64_t)1 << random_i64(0, MAX_ALIGNMENT_LOG2);
+        }
+
         clock_t start = clock(); 
-        void *our_memory = HeapArenaAllocate(&arena, to_allocate);
+        void *our_memory = HeapArenaAllocateAligned(&arena, to_allocate, alignment);
         our_clocks += (clock() - start);
+        assert(((uintptr_t)our_memory & (alignment - 1)) == 0 && "Memory is not aligned");
+        assert(((uintptr_t)our_memory & (ALLOCATION_GRANULARITY - 1)) == 0 && "Memory is not aligned");
 
         start = clock();
         void *malloc_memory = malloc(to_allocate);
@@ -259,8 +597,9 @@ int main() {
         memory_index += 1;
 
         CheckMemory(our_memory_list, malloc_memory_list, memory_index);
-        TestAllocatorIntegrity(&arena, epoch_allocated_size); 
-        TestRBTIntegrity(arena.root);
+        TestAllocatorIntegrity(&arena); 
+        TestLiveStats(&arena, our_memory_list, memory_index);
+        TestFreeIndexIntegrity(&arena);
 
         int64_t roll = random_i64(0, 100);
         if (roll < CHANCE_TO_REALLOCATE) {
@@ -275,6 +614,7 @@ int main() {
             maybe_printf("Iteration(%lld), reallocating(%p) from %lld to %lld bytes\n", i, GetAllocationNode(our_memory_to_extend.ptr), old_size, new_size);
 
             void *new_ptr = HeapArenaRealloc(&arena, our_memory_to_extend.ptr, new_size);
+            assert(((uintptr_t)new_ptr & (ALLOCATION_GRANULARITY - 1)) == 0 && "Memory is not aligned");
             void *new_malloc_memory = realloc(malloc_memory_to_extend.ptr, new_size);
             maybe_printf("\tOld address(%p), New address(%p)\n", GetAllocationNode(our_memory_to_extend.ptr), GetAllocationNode(new_ptr));
 
@@ -288,8 +628,9 @@ int main() {
             malloc_memory_list[index_to_extend] = (Memory){new_malloc_memory, new_size};
             random_fill(new_ptr, new_malloc_memory, new_size);
             CheckMemory(our_memory_list, malloc_memory_list, memory_index);
-            TestAllocatorIntegrity(&arena, epoch_allocated_size); 
-            TestRBTIntegrity(arena.root);
+            TestAllocatorIntegrity(&arena); 
+            TestLiveStats(&arena, our_memory_list, memory_index);
+            TestFreeIndexIntegrity(&arena);
 #if PRINT_STEPS
             HeapArenaDump(&arena);
             maybe_printf("\n\n");
@@ -313,13 +654,28 @@ int main() {
 
             memory_index -= 1;
             CheckMemory(our_memory_list, malloc_memory_list, memory_index);
-            TestAllocatorIntegrity(&arena, epoch_allocated_size);
-            TestRBTIntegrity(arena.root);
+            TestAllocatorIntegrity(&arena);
+            TestLiveStats(&arena, our_memory_list, memory_index);
+            TestFreeIndexIntegrity(&arena);
 #if PRINT_STEPS
             HeapArenaDump(&arena);
             maybe_printf("\n\n");
 #endif
         }
+        if (roll < CHANCE_TO_BATCH) {
+            maybe_printf("Iteration(%lld), batch\n", i);
+            TestBatch(&arena, our_memory_list, memory_index);
+            CheckMemory(our_memory_list, malloc_memory_list, memory_index);
+        }
+        if (roll < CHANCE_TO_TRIM) {
+            int64_t released_size = HeapArenaTrim(&arena, 0);
+            maybe_printf("Iteration(%lld), trimmed %lld bytes\n", i, released_size);
+            CheckMemory(our_memory_list, malloc_memory_list, memory_index);
+            TestAllocatorIntegrity(&arena);
+            TestLiveStats(&arena, our_memory_list, memory_index);
+            TestFreeIndexIntegrity(&arena);
+        }
+        TestValidateStep(&arena);
     }
    
     printf("-------Epoch %lld is finished-------\n", epoch);
@@ -329,6 +685,7 @@ int main() {
     printf("Arena: Free size: %lld\n", arena.free_size);
     printf("Epoch: Allocted size: %lld\n", epoch_allocated_size);
 
+    TestValidateReports(&arena);
     HeapArenaRelease(&arena);
     for (int64_t index=0;index<memory_index;++index) {
         Memory mem = malloc_memory_list[index];
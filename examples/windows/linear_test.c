@@ -0,0 +1,174 @@
+#define EPOCH_COUNT 0
+#define PRINT_STEPS  FALSE
+#define ALLOCATIONS_COUNT 4096
+#define MAX_AMOUNT_TO_ALLOCATE 4096
+#define MAX_BIG_AMOUNT_TO_ALLOCATE 4 * 1024 * 1024
+#define CHANCE_TO_ALLOCATE_BIG 0.01f
+#define CHANCE_TO_REALLOCATE 0.2f
+#define RESERVED_SIZE 1024 * 1024 * 1024
+#define RETAINED_SIZE 1024 * 1024
+
+#include "stdlib.h"
+#include "assert.h"
+#include "stdio.h"
+#include "time.h"
+#include "stdarg.h"
+
+#define ALLOCATORS_IMPLEMENTATION
+#define ALLOCATORS_LINEAR_ARENA
+#include "allocators.h"
+
+
+#include "windows.h"
+void *PlatformGetMemory(int64_t size) {
+    void *memory = VirtualAlloc(0, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    assert(memory);
+    return memory; 
+}
+
+void PlatformFreeMemory(void *memory, int64_t size) {
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+void *PlatformReserveMemory(int64_t size) {
+    return VirtualAlloc(0, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool PlatformCommitMemory(void *memory, int64_t size) {
+    return VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != 0;
+}
+
+void PlatformDecommitMemory(void *memory, int64_t size) {
+    VirtualFree(memory, size, MEM_DECOMMIT);
+}
+
+int64_t random_i64(int64_t min, int64_t max) {
+    assert(min <= max);
+    int64_t res = min + ((int64_t)rand() * (RAND_MAX + 1ll) + rand()) % (max - min + 1);
+    return res;
+}
+
+uint8_t random_byte(uint8_t min, uint8_t max) {
+    assert(min <= max);
+    uint8_t res = min + rand() % (max - min + 1);
+    return res;
+}
+
+float random_float_01() {
+    float value = (float)rand();
+    value /= (float)RAND_MAX;
+    return value;
+}
+
+void maybe_printf(char *format, ...) {
+#if PRINT_STEPS
+    va_list args;
+    va_start(args, format); 
+    vprintf(format, args);
+    va_end(args);
+#endif
+}
+
+typedef struct Memory Memory;
+struct Memory {
+    void *ptr;
+    int64_t size;
+};
+
+void CheckMemory(Memory *memory_array, Memory *reference_array, int64_t count) {
+    for (int64_t i=0;i<count;++i) {
+        Memory memory    = memory_array[i]; 
+        Memory reference = reference_array[i];
+    
+        assert(memory.size == reference.size && "Internal memory size mismatch"); 
+        if (memcmp(memory.ptr, reference.ptr, memory.size) != 0) {
+            assert(0 && "memory is corrupted");
+        }
+    }
+}
+
+int64_t RandomSize(void) {
+    if (random_float_01() < CHANCE_TO_ALLOCATE_BIG) {
+        return random_i64(0, MAX_BIG_AMOUNT_TO_ALLOCATE);
+    }
+    return random_i64(0, MAX_AMOUNT_TO_ALLOCATE);
+}
+
+void RandomFill(uint8_t *first, uint8_t *second, int64_t size) {
+    for (int64_t byte_index=0;byte_index<size;++byte_index) {
+        uint8_t byte = random_byte(0, 255);
+        first[byte_index]  = byte;
+        second[byte_index] = byte;
+    }
+}
+
+void TestZeroSize(void) {
+    LinearArena arena = {0};
+    LinearArenaInit(&arena, RESERVED_SIZE, RETAINED_SIZE);
+    uint8_t *empty = LinearArenaAlloc(&arena, 0);
+    assert(empty && "Zero size allocation on a fresh arena failed");
+    assert(arena.cursor == 0 && "Zero size allocation took space");
+
+    uint8_t *next = LinearArenaAlloc(&arena, 16);
+    assert(next == empty && "Zero size allocation isn't at the cursor");
+    assert(LinearArenaAlloc(&arena, 0) == next + 16 && "Zero size allocation isn't at the cursor");
+    LinearArenaDestroy(&arena);
+}
+
+int main() {
+    srand(time(0));
+    TestZeroSize();
+
+    LinearArena arena = {0};
+    LinearArenaInit(&arena, RESERVED_SIZE, RETAINED_SIZE);
+    int64_t epoch = 0;
+
+    Memory *our_memory_list    = malloc(ALLOCATIONS_COUNT * sizeof(Memory));
+    Memory *malloc_memory_list = malloc(ALLOCATIONS_COUNT * sizeof(Memory));
+#if !EPOCH_COUNT
+    while(true) {
+#else 
+    for (;epoch<EPOCH_COUNT;) {
+#endif
+        for (int64_t j=0;j<ALLOCATIONS_COUNT;++j) {
+            int64_t to_allocate = RandomSize();
+            maybe_printf("Allocation: %lld. Allocating %lld\n", j, to_allocate);
+
+            uint8_t *res = LinearArenaAlloc(&arena, to_allocate);
+            uint8_t *check = malloc(to_allocate);
+            assert(res && "Reservation is used up");
+            assert(arena.cursor <= arena.committed_size);
+
+            RandomFill(res, check, to_allocate);
+            our_memory_list[j]    = (Memory){res,   to_allocate};
+            malloc_memory_list[j] = (Memory){check, to_allocate};
+
+            if (random_float_01() < CHANCE_TO_REALLOCATE) { 
+                int64_t new_size = RandomSize();
+                maybe_printf("Reallocating. New size: %lld\n", new_size);
+
+                uint8_t *realloc_res = LinearArenaReallocLast(&arena, res, new_size);
+                uint8_t *realloc_check = realloc(check, new_size);
+                assert(realloc_res == res && "Last allocation has moved");
+                assert(arena.cursor <= arena.committed_size);
+
+                int64_t kept_size = new_size < to_allocate ? new_size : to_allocate;
+                RandomFill(realloc_res + kept_size, realloc_check + kept_size, new_size - kept_size);
+                our_memory_list[j]    = (Memory){realloc_res,   new_size};
+                malloc_memory_list[j] = (Memory){realloc_check, new_size};
+            }
+        }
+        CheckMemory(our_memory_list, malloc_memory_list, ALLOCATIONS_COUNT);
+        printf("Arena: Used size: %lld, committed size: %lld\n", arena.cursor, arena.committed_size);
+        printf("-------Epoch %lld is finished-------\n", epoch);
+        epoch += 1;
+        LinearArenaReset(&arena);
+        assert(arena.committed_size <= RETAINED_SIZE && "Reset didn't decommit the memory above the retained size");
+
+        for (int64_t index=0;index<ALLOCATIONS_COUNT;++index) {
+            Memory mem = malloc_memory_list[index];
+            free(mem.ptr);
+        }
+    }
+    LinearArenaDestroy(&arena);
+}
@@ -0,0 +1,102 @@
+#define EPOCH_COUNT 0
+#define OBJECT_SIZE 40
+#define MAX_OBJECT_COUNT 100000
+#define OPERATION_COUNT 200000
+#define CHANCE_TO_FREE 0.45f
+
+#include "stdlib.h"
+#include "assert.h"
+#include "stdio.h"
+#include "time.h"
+
+#define ALLOCATORS_IMPLEMENTATION
+#include "allocators.h"
+
+
+#include "windows.h"
+void *PlatformGetMemory(int64_t size) {
+    void *memory = VirtualAlloc(0, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    assert(memory);
+    return memory; 
+}
+
+void PlatformFreeMemory(void *memory, int64_t size) {
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+int64_t random_i64(int64_t min, int64_t max) {
+    assert(min <= max);
+    int64_t res = min + ((int64_t)rand() * (RAND_MAX + 1ll) + rand()) % (max - min + 1);
+    return res;
+}
+
+float random_float_01() {
+    float value = (float)rand();
+    value /= (float)RAND_MAX;
+    return value;
+}
+
+// every live object is filled with its own index, so overlapping slots or a slot given out twice corrupt the other object
+void FillObject(uint8_t *object, uint32_t index) {
+    for (int64_t i=0;i<OBJECT_SIZE;++i) {
+        object[i] = (uint8_t)(index + i);
+    }
+}
+
+void CheckObject(PoolArena *arena, uint8_t *object) {
+    uint32_t index = PoolArenaGetIndex(arena, object);
+    assert(PoolArenaFromIndex(arena, index) == object && "Index doesn't lead back to the object");
+    for (int64_t i=0;i<OBJECT_SIZE;++i) {
+        assert(object[i] == (uint8_t)(index + i) && "Object is corrupted");
+    }
+}
+
+int main() {
+    srand(time(0));
+
+    PoolArena arena;
+    PoolArenaInit(&arena, OBJECT_SIZE);
+    uint8_t **objects = malloc(MAX_OBJECT_COUNT * sizeof(uint8_t*));
+    int64_t epoch = 0;
+#if !EPOCH_COUNT
+    while(true) {
+#else 
+    for (;epoch<EPOCH_COUNT;) {
+#endif
+        int64_t count = 0;
+        clock_t begin = clock();
+        for (int64_t j=0;j<OPERATION_COUNT;++j) {
+            if (count && (count == MAX_OBJECT_COUNT || random_float_01() < CHANCE_TO_FREE)) {
+                int64_t victim = random_i64(0, count - 1);
+                CheckObject(&arena, objects[victim]);
+                PoolArenaFree(&arena, objects[victim]);
+                objects[victim] = objects[--count];
+            } else {
+                uint8_t *object = PoolArenaAllocate(&arena);
+                assert(((uintptr_t)object & (sizeof(void*) - 1)) == 0 && "Object is misaligned");
+                FillObject(object, PoolArenaGetIndex(&arena, object));
+                objects[count++] = object;
+            }
+            assert(arena.used_count == count);
+        }
+        for (int64_t j=0;j<count;++j) {
+            CheckObject(&arena, objects[j]);
+        }
+        printf("Live objects: %lld, slabs: %lld, time: %f seconds\n", count, arena.slab_count, (double)(clock() - begin) / CLOCKS_PER_SEC);
+
+        int64_t slab_count = arena.slab_count;
+        PoolArenaReset(&arena);
+        for (int64_t j=0;j<count;++j) {
+            objects[j] = PoolArenaAllocate(&arena);
+        }
+        assert(arena.slab_count == slab_count && "Reset didn't keep the slabs");
+        for (int64_t j=0;j<count;++j) {
+            assert(PoolArenaGetIndex(&arena, objects[j]) == j && "Objects after reset aren't given out in order");
+        }
+        PoolArenaReset(&arena);
+
+        printf("-------Epoch %lld is finished-------\n", epoch);
+        epoch += 1;
+    }
+    PoolArenaRelease(&arena);
+}
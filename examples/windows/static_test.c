@@ -3,6 +3,8 @@
 #define ALLOCATIONS_COUNT 4096
 #define STATIC_ARENA_PAGE_TOTAL_SIZE 1024
 #define MAX_AMOUNT_TO_ALLOCATE STATIC_ARENA_PAGE_TOTAL_SIZE - sizeof(uint8_t*)
+#define MAX_OVERSIZED_AMOUNT   4 * STATIC_ARENA_PAGE_TOTAL_SIZE
+#define CHANCE_TO_OVERSIZE   0.02f
 #define CHANCE_TO_REALLOCATE 0.2f
 #define CHANCE_TO_RESET      0.000f
 
@@ -23,7 +25,7 @@ void *PlatformGetMemory(int64_t size) {
     return memory; 
 }
 
-void PlatformFreeMemory(void *memory) {
+void PlatformFreeMemory(void *memory, int64_t size) {
     VirtualFree(memory, 0, MEM_RELEASE);
 }
 
@@ -78,6 +80,36 @@ void CheckMemory(Memory *memory_array, Memory *reference_array, int64_t count) {
     }
 }
 
+// Result is returned in the scratch arena of the caller, temporary memory comes from the other one
+uint8_t *FillScratch(StaticArena *result_arena, int64_t size, uint8_t byte) {
+    StaticArenaCheckpoint temporary = StaticArenaGetScratch(&result_arena, 1);
+    assert(temporary.arena != result_arena && "Scratch arena conflicts with the caller's one");
+
+    uint8_t *buffer = StaticArenaAlloc(temporary.arena, size);
+    memset(buffer, byte, size);
+    uint8_t *result = StaticArenaAlloc(result_arena, size);
+    memcpy(result, buffer, size);
+
+    StaticArenaRestore(temporary);
+    assert(temporary.arena->current_page_cursor == temporary.cursor && "Restore didn't rewind the arena");
+    return result;
+}
+
+void TestScratch(void) {
+    StaticArenaCheckpoint scratch = StaticArenaGetScratch(0, 0);
+    Memory results[64];
+    for (int64_t i=0;i<64;++i) {
+        int64_t size = random_i64(0, MAX_OVERSIZED_AMOUNT);
+        results[i] = (Memory){FillScratch(scratch.arena, size, (uint8_t)i), size};
+    }
+    for (int64_t i=0;i<64;++i) {
+        for (int64_t j=0;j<results[i].size;++j) {
+            assert(((uint8_t*)results[i].ptr)[j] == (uint8_t)i && "Scratch result is overwritten");
+        }
+    }
+    StaticArenaRestore(scratch);
+}
+
 int main() {
     srand(time(0));
 
@@ -93,6 +125,9 @@ int main() {
 #endif
         for (int64_t j=0;j<ALLOCATIONS_COUNT;++j) {
             int64_t to_allocate = random_i64(0, MAX_AMOUNT_TO_ALLOCATE);
+            if (random_float_01() < CHANCE_TO_OVERSIZE) {
+                to_allocate = random_i64(0, MAX_OVERSIZED_AMOUNT);
+            }
             maybe_printf("Allocation: %lld. Allocating %lld\n", j, to_allocate);
 
             uint8_t *res = StaticArenaAlloc(&arena, to_allocate);
@@ -111,6 +146,9 @@ int main() {
             float roll = random_float_01();
             if (roll < CHANCE_TO_REALLOCATE) { 
                 int64_t new_size = random_i64(0, MAX_AMOUNT_TO_ALLOCATE);
+                if (random_float_01() < CHANCE_TO_OVERSIZE) {
+                    new_size = random_i64(0, MAX_OVERSIZED_AMOUNT);
+                }
                 maybe_printf("Reallocating. New size: %lld\n", new_size);
 
                 uint8_t *realloc_res = StaticArenaReallocLast(&arena, res, new_size);
@@ -137,6 +175,7 @@ int main() {
             } 
             
         }
+        TestScratch();
         printf("-------Epoch %lld is finished-------\n", epoch);
         epoch += 1;
         StaticArenaReset(&arena);
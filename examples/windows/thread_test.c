@@ -0,0 +1,181 @@
+#define PRINT_STEPS FALSE
+#define THREAD_COUNT           8
+#define ROUND_COUNT            200
+#define ALLOCATIONS_PER_THREAD 2000
+#define MAX_AMOUNT_TO_ALLOCATE 1234
+#define CHANCE_TO_REALLOCATE   25
+#define ALIGNED_COUNT          16
+#define MAX_ALIGNMENT_LOG2     16
+
+#include "stdlib.h"
+#include "assert.h"
+#include "stdio.h"
+#include "time.h"
+
+#define ALLOCATORS_THREAD_SAFE
+#define ALLOCATORS_IMPLEMENTATION
+#include "allocators.h"
+
+#include "windows.h"
+void *PlatformGetMemory(int64_t size) {
+    void *memory = VirtualAlloc(0, size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+    assert(memory);
+    return memory; 
+}
+
+void PlatformFreeMemory(void *memory, int64_t size) {
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+// note: rand() isn't guaranteed to be thread-safe, so every thread has its own generator
+uint64_t random_u64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+int64_t random_i64(uint64_t *state, int64_t min, int64_t max) {
+    assert(min <= max);
+    int64_t res = min + (int64_t)(random_u64(state) % (uint64_t)(max - min + 1));
+    return res;
+}
+
+typedef struct Memory Memory;
+struct Memory {
+    uint8_t *ptr;
+    int64_t size;
+    uint8_t seed;
+};
+
+void FillMemory(Memory memory) {
+    for (int64_t i=0;i<memory.size;++i) {
+        memory.ptr[i] = (uint8_t)(memory.seed + i);
+    }
+}
+
+void CheckMemory(Memory memory) {
+    for (int64_t i=0;i<memory.size;++i) {
+        if (memory.ptr[i] != (uint8_t)(memory.seed + i)) {
+            assert(0 && "memory is corrupted");
+        }
+    }
+}
+
+// Every round each thread frees memory that its neighbour allocated during the previous round, so most of the frees are remote
+Memory memory_lists[2][THREAD_COUNT][ALLOCATIONS_PER_THREAD];
+
+typedef struct ThreadData ThreadData;
+struct ThreadData {
+    int64_t index;
+    int64_t round;
+    uint64_t random_state;
+};
+
+DWORD WINAPI ThreadProc(LPVOID param) {
+    ThreadData *data = param;
+
+    if (data->round) {
+        int64_t neighbour = (data->index + 1) % THREAD_COUNT;
+        Memory *to_free = memory_lists[(data->round + 1) % 2][neighbour];
+        for (int64_t i=0;i<ALLOCATIONS_PER_THREAD;++i) {
+            CheckMemory(to_free[i]);
+            ThreadHeapFree(to_free[i].ptr);
+        }
+    }
+
+    Memory *to_allocate = memory_lists[data->round % 2][data->index];
+    for (int64_t i=0;i<ALLOCATIONS_PER_THREAD;++i) {
+        Memory memory = {0};
+        memory.size = random_i64(&data->random_state, 0, MAX_AMOUNT_TO_ALLOCATE);
+        memory.seed = (uint8_t)random_u64(&data->random_state);
+        memory.ptr  = ThreadHeapAllocate(memory.size);
+        FillMemory(memory);
+
+        if (random_i64(&data->random_state, 0, 100) < CHANCE_TO_REALLOCATE) {
+            int64_t new_size = random_i64(&data->random_state, 0, MAX_AMOUNT_TO_ALLOCATE);
+            if (new_size < memory.size) {
+                memory.size = new_size;
+            }
+            memory.ptr = ThreadHeapRealloc(memory.ptr, new_size);
+            CheckMemory(memory);
+
+            memory.size = new_size;
+            FillMemory(memory);
+        }
+        to_allocate[i] = memory;
+    }
+
+    ThreadHeapRelease();
+    return 0;
+}
+
+// Aligned memory of the large size is allocated by one thread and freed or reallocated by the other. In debug mode (ALLOCATORS_DEBUG)
+// user memory starts alignment bytes after the start of the mapping, so it lies on another page, which the page map has to know as well
+Memory aligned_memory[ALIGNED_COUNT];
+
+DWORD WINAPI FreeAlignedProc(LPVOID param) {
+    for (int64_t i=0;i<ALIGNED_COUNT;++i) {
+        Memory memory = aligned_memory[i];
+        CheckMemory(memory);
+        if (i % 2) {
+            memory.ptr = ThreadHeapRealloc(memory.ptr, memory.size * 2);
+            CheckMemory(memory);
+        }
+        ThreadHeapFree(memory.ptr);
+    }
+    ThreadHeapRelease();
+    return 0;
+}
+
+void TestRemoteAlignedFree(uint64_t *random_state) {
+    for (int64_t i=0;i<ALIGNED_COUNT;++i) {
+        int64_t alignment = (int64_t)1 << random_i64(random_state, 12, MAX_ALIGNMENT_LOG2);
+        Memory memory = {0};
+        memory.size = HEAP_ARENA_LARGE_ALLOCATION_SIZE + random_i64(random_state, 0, MAX_AMOUNT_TO_ALLOCATE);
+        memory.seed = (uint8_t)random_u64(random_state);
+        memory.ptr  = ThreadHeapAllocateAligned(memory.size, alignment);
+        assert(((uintptr_t)memory.ptr & (alignment - 1)) == 0 && "Aligned memory is misaligned");
+        FillMemory(memory);
+        aligned_memory[i] = memory;
+    }
+
+    HANDLE thread = CreateThread(0, 0, FreeAlignedProc, 0, 0, 0);
+    assert(thread);
+    WaitForMultipleObjects(1, &thread, TRUE, INFINITE);
+    CloseHandle(thread);
+    // note: frees made by the other thread are queued to this heap, release processes them
+    ThreadHeapRelease();
+}
+
+int main() {
+    srand(time(0));
+
+    uint64_t random_state = (uint64_t)rand() * 2654435761u + 1;
+    TestRemoteAlignedFree(&random_state);
+
+    ThreadData data[THREAD_COUNT] = {0};
+    for (int64_t i=0;i<THREAD_COUNT;++i) {
+        data[i].index = i;
+        data[i].random_state = (uint64_t)rand() * 2654435761u + 1;
+    }
+
+    clock_t start = clock();
+    for (int64_t round=0;round<ROUND_COUNT;++round) {
+        HANDLE threads[THREAD_COUNT];
+        for (int64_t i=0;i<THREAD_COUNT;++i) {
+            data[i].round = round;
+            threads[i] = CreateThread(0, 0, ThreadProc, &data[i], 0, 0);
+            assert(threads[i]);
+        }
+        WaitForMultipleObjects(THREAD_COUNT, threads, TRUE, INFINITE);
+        for (int64_t i=0;i<THREAD_COUNT;++i) {
+            CloseHandle(threads[i]);
+        }
+    }
+
+    printf("-------%d rounds are finished-------\n", ROUND_COUNT);
+    printf("Time: %lf seconds\n", (float)(clock() - start)/(float)CLOCKS_PER_SEC);
+}
@@ -8,7 +8,7 @@ void *PlatformGetMemory(int64_t size) {
     return memory; 
 }
 
-void PlatformFreeMemory(void *memory) {
+void PlatformFreeMemory(void *memory, int64_t size) {
     VirtualFree(memory, 0, MEM_RELEASE);
 }
 